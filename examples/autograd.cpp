@@ -9,6 +9,7 @@
 
 #include <af/autograd.h>
 #include <af/nn.h>
+#include <af/optim.h>
 
 #include <iostream>
 
@@ -99,6 +100,16 @@ void test_multiply_add_scalar()
     VERIFY(dy.array() - (1.0 + x.array()));
 }
 
+void test_scalar_ops()
+{
+    auto x = Variable(af::randu(5) + 0.1, true);
+    auto z = 3 / x + max(x, 0.5) - x / 2 + (1 - x);
+    auto dz = Variable(af::constant(1.0, 5), false);
+    z.backward(dz);
+    auto dx = x.grad();
+    VERIFY(dx.array() - (-3 / (x.array() * x.array()) + (x.array() > 0.5) - 0.5 - 1));
+}
+
 void test_exp()
 {
     auto x = Variable(af::randu(5), true);
@@ -109,6 +120,16 @@ void test_exp()
     VERIFY(dx.array() - (af::exp(x.array())));
 }
 
+void test_reciprocal()
+{
+    auto x = Variable(af::randu(5) + 1, true);
+    auto y = reciprocal(x);
+    auto dy = Variable(af::constant(1.0, 5), false);
+    y.backward(dy);
+    auto dx = x.grad();
+    VERIFY(dx.array() + 1 / (x.array() * x.array()));
+}
+
 void test_sigmoid()
 {
     auto x = Variable(af::randu(5), true);
@@ -144,6 +165,19 @@ void test_tile()
     VERIFY(dx.array() - af::sum(y.array(), 1));
 }
 
+void test_broadcast()
+{
+    auto x = Variable(af::randu(5), true);
+    auto y = Variable(af::randu(5, 2), true);
+    auto z = y * x + x;
+    auto dz = Variable(af::constant(1.0, 5, 2), false);
+    z.backward(dz);
+    auto dy = y.grad();
+    auto dx = x.grad();
+    VERIFY(dy.array() - af::tile(x.array(), 1, 2));
+    VERIFY(dx.array() - af::sum(y.array(), 1) - 2);
+}
+
 void test_sum()
 {
     auto x = Variable(af::randu(5), true);
@@ -166,10 +200,555 @@ void test_mean()
     z.backward(dz);
     auto dy = y.grad();
     auto dx = x.grad();
-    VERIFY(dy.array() - 6 * af::tile(x.array(), 1, 3, 2));
+    VERIFY(dy.array() - af::tile(x.array(), 1, 3, 2) / 6);
     VERIFY(dx.array() - af::mean(af::mean(y.array(), 1), 2));
 }
 
+void test_no_grad_guard()
+{
+    auto x = Variable(af::randu(5), true);
+    {
+        af::autograd::NoGradGuard guard;
+        auto y = x * x;
+        VERIFY(af::constant(y.isCalcGrad(), 1));
+    }
+    auto z = x * x;
+    VERIFY(af::constant(!z.isCalcGrad(), 1));
+}
+
+void test_checkpoint()
+{
+    auto x = Variable(af::randu(5), true);
+    auto w = Variable(af::randu(5), true);
+    auto fn = [&w](const std::vector<Variable> &inputs) {
+        return tanh(inputs[0] * w) * inputs[0];
+    };
+
+    auto y = fn({x});
+    y.backward();
+    auto dx = x.grad().array();
+    auto dw = w.grad().array();
+
+    x.zeroGrad();
+    w.zeroGrad();
+    auto z = af::autograd::checkpoint(fn, {x}, {w});
+    z.backward();
+    VERIFY(x.grad().array() - dx);
+    VERIFY(w.grad().array() - dw);
+
+    // The recomputation draws the same dropout mask as the forward pass.
+    auto v = Variable(af::randu(100) + 1, false);
+    auto u = Variable(af::randu(100) + 1, true);
+    auto drop = [&u](const std::vector<Variable> &inputs) {
+        return dropout(inputs[0] * u, 0.5);
+    };
+    auto d = af::autograd::checkpoint(drop, {v}, {u});
+    d.backward();
+    VERIFY(u.grad().array() - (d.array() != 0) * v.array() / 0.5);
+
+    // A param that is itself computed receives the checkpoint's gradient along with the rest.
+    auto p0 = Variable(af::randu(5), true);
+    auto p = p0 * 2;
+    auto scale = [&p](const std::vector<Variable> &inputs) {
+        return inputs[0] * p;
+    };
+    auto q = p * 3 + af::autograd::checkpoint(scale, {x}, {p});
+    q.backward();
+    VERIFY(p0.grad().array() - 2 * (x.array() + 3));
+}
+
+void test_tape()
+{
+    auto w = Variable(af::randu(5), true);
+    auto step = [&w](const std::vector<Variable> &inputs) {
+        return sum(sigmoid(inputs[0] * w) * inputs[1], {0});
+    };
+    af::autograd::Tape tape(step);
+
+    std::ptrdiff_t recorded = 0;
+    for (int i = 0; i < 3; i++) {
+        af::array x = af::randu(5);
+        af::array y = af::randu(5);
+
+        w.zeroGrad();
+        auto loss = tape.replay({x, y});
+        auto dw = w.grad().array();
+
+        // Replays refill the recorded nodes rather than building new ones.
+        if (i == 0) recorded = loss.id();
+        VERIFY(af::constant(loss.id() != recorded, 1));
+
+        w.zeroGrad();
+        auto expected = step({Variable(x, false), Variable(y, false)});
+        expected.backward();
+        VERIFY(loss.array() - expected.array());
+        VERIFY(w.grad().array() - dw);
+    }
+
+    // A step whose graph changes between calls is refused.
+    int calls = 0;
+    af::autograd::Tape changing([&w, &calls](const std::vector<Variable> &inputs) {
+            auto h = inputs[0] * w;
+            return calls++ == 0 ? sum(h, {0}) : sum(exp(h), {0});
+        });
+    changing.replay({af::randu(5)});
+    bool threw = false;
+    try {
+        changing.replay({af::randu(5)});
+    } catch (af::exception &ex) {
+        threw = true;
+    }
+    VERIFY(af::constant(!threw, 1));
+}
+
+void test_grad()
+{
+    auto x = Variable(af::randu(5), true);
+    auto w = Variable(af::randu(5), true);
+    auto y = x * w + w;
+    auto dx = af::autograd::grad({y}, {x})[0];
+    VERIFY(dx.array() - w.array());
+    VERIFY(af::constant(w.isGradAvailable() || x.isGradAvailable(), 1));
+
+    // z lies outside the subgraph from q to x, the retained gradient graph still depends on it.
+    auto z = Variable(af::randu(5) + 1, true);
+    auto q = x / z;
+    auto dq = af::autograd::grad({q}, {x}, {}, true)[0];
+    auto dqdz = af::autograd::grad({dq}, {z})[0];
+    VERIFY(dqdz.array() + 1 / (z.array() * z.array()));
+
+    y.backward();
+    VERIFY(x.grad().array() - w.array());
+    VERIFY(w.grad().array() - x.array() - 1);
+
+    // An input the outputs don't reach gets zeros, not what backward left in it.
+    auto unused = Variable(af::randu(5), true);
+    (unused * 2).backward();
+    auto s = x * x;
+    auto ds = af::autograd::grad({s}, {x, unused});
+    VERIFY(ds[0].array() - 2 * x.array());
+    VERIFY(ds[1].array());
+    VERIFY(unused.grad().array() - 2);
+    VERIFY(x.grad().array() - w.array());
+}
+
+void test_multi_root_backward()
+{
+    auto x = Variable(af::randu(5), true);
+    auto trunk = tanh(x);
+    auto head1 = trunk * trunk;
+    auto head2 = 3 * trunk;
+    af::autograd::backward({head1, head2});
+    auto t = af::tanh(x.array());
+    VERIFY(x.grad().array() - (2 * t + 3) * (1 - t * t));
+}
+
+void test_parallel_backward()
+{
+    auto x = Variable(af::randu(5), true);
+    auto w = Variable(af::randu(5), true);
+    auto model = [&x, &w]() {
+        auto trunk = x * w;
+        auto branch1 = tanh(trunk) * w;
+        auto branch2 = sigmoid(trunk + x);
+        auto branch3 = exp(trunk) / (w + 1);
+        return branch1 + branch2 * branch3 + trunk;
+    };
+
+    model().backward();
+    auto dx = x.grad().array();
+    auto dw = w.grad().array();
+
+    x.zeroGrad();
+    w.zeroGrad();
+    af::autograd::setBackwardThreads(4);
+    model().backward();
+    af::autograd::setBackwardThreads(1);
+    VERIFY(x.grad().array() - dx);
+    VERIFY(w.grad().array() - dw);
+
+    // The seed is shared by both inputs of the add and is left as it was passed.
+    auto s = Variable(af::constant(1, 5), true);
+    auto seed = s * 2;
+    af::autograd::setBackwardThreads(4);
+    (x * w + w).backward(seed);
+    af::autograd::setBackwardThreads(1);
+    VERIFY(af::constant(!seed.isCalcGrad(), 1));
+    VERIFY(af::autograd::grad({seed}, {s})[0].array() - 2);
+}
+
+void test_grad_hook()
+{
+    auto x = Variable(af::randu(5), true);
+    auto w = Variable(af::randu(5), true);
+    int calls = 0;
+    af::array hooked;
+    w.registerGradHook([&calls, &hooked](Variable &var) {
+            calls++;
+            hooked = var.grad().array();
+        });
+    auto y = x * w + w * w;
+    y.backward();
+    VERIFY(hooked - w.grad().array());
+    VERIFY(af::constant(calls - 1, 1));
+}
+
+void test_profiler()
+{
+    using af::autograd::Profiler;
+    auto x = Variable(af::randu(5), true);
+    auto w = Variable(af::randu(5), true);
+
+    Profiler::clear();
+    Profiler::start();
+    auto y = exp(x * w);
+    y.backward();
+    Profiler::stop();
+    auto z = x * w;
+
+    int forward = 0, backward = 0;
+    for (const auto &event : Profiler::events()) {
+        if (event.phase == "forward") forward++;
+        if (event.phase == "backward") backward++;
+    }
+    VERIFY(af::constant(forward - 2, 1));
+    VERIFY(af::constant(backward - 2, 1));
+    Profiler::clear();
+}
+
+void test_memory_tracker()
+{
+    using af::autograd::MemoryTracker;
+    auto x = Variable(af::randu(5), true);
+    auto w = Variable(af::randu(5), true);
+    size_t bytes = x.array().bytes();
+
+    MemoryTracker::start();
+    MemoryTracker::resetPeak();
+    auto base = MemoryTracker::report({x, w});
+    {
+        auto y = exp(x * w);
+        auto during = MemoryTracker::report({x, w});
+        VERIFY(af::constant((double)(during.activations - base.activations - 2 * bytes), 1));
+        y.backward();
+    }
+    auto after = MemoryTracker::report({x, w});
+    MemoryTracker::stop();
+    VERIFY(af::constant((double)(after.activations - base.activations), 1));
+    VERIFY(af::constant((double)(after.gradients - base.gradients - 2 * bytes), 1));
+    VERIFY(af::constant((double)(after.parameters - 2 * bytes), 1));
+    x.zeroGrad();
+    w.zeroGrad();
+}
+
+void test_backward_cache()
+{
+    auto x = Variable(af::randu(5), true);
+    auto z = Variable(af::randu(5) + 1, true);
+    {
+        af::autograd::BackwardCache cache(true);
+        VERIFY(af::constant((double)(reciprocal(z).id() - reciprocal(z).id()), 1));
+    }
+
+    // Both divisions share reciprocal(z) in the retained gradient graph.
+    auto y = x / z + x / z;
+    auto dx = af::autograd::grad({y}, {x}, {}, true)[0];
+    VERIFY(dx.array() - 2 / z.array());
+    auto dxdz = af::autograd::grad({dx}, {z})[0];
+    VERIFY(dxdz.array() + 2 / (z.array() * z.array()));
+
+    // cos caches sin(w) from its backward, the recomputed checkpoint must not reuse it.
+    auto w = Variable(af::randu(5), true);
+    auto fn = [&w](const std::vector<Variable> &inputs) {
+        return sin(w) * inputs[0];
+    };
+    auto v = Variable(af::randu(5), false);
+    auto c = cos(w) + af::autograd::checkpoint(fn, {v}, {w});
+    c.backward();
+    VERIFY(w.grad().array() - (af::cos(w.array()) * v.array() - af::sin(w.array())));
+
+    w.zeroGrad();
+    auto d = af::autograd::checkpoint(fn, {v}, {w}) + cos(w);
+    d.backward();
+    VERIFY(w.grad().array() - (af::cos(w.array()) * v.array() - af::sin(w.array())));
+}
+
+void test_mixed_precision()
+{
+    auto w = Variable(af::constant(1, 5, af::f16), true);
+    auto x = Variable(af::randu(5, af::f16), false);
+    af::optim::SGDOptimizer optim(std::vector<Variable>{w}, 1);
+    optim.setLossScaling(1024);
+
+    optim.scaleLoss(sum(w * x, {0})).backward();
+    VERIFY(af::constant(optim.update() - 1, 1));
+    // The f32 master weight is written back rounded to af::f16.
+    VERIFY(w.array().as(af::f32) - (1 - x.array().as(af::f32)).as(af::f16).as(af::f32));
+    VERIFY(af::constant(w.type() != af::f16, 1));
+
+    // The scaled gradient overflows af::f16: the step is skipped and the scale halved.
+    af::array prev = w.array();
+    optim.zeroGrad();
+    optim.scaleLoss(sum(w * 1E5, {0})).backward();
+    VERIFY(af::constant(optim.update(), 1));
+    VERIFY(w.array() - prev);
+    VERIFY(af::constant(optim.getLossScale() - 512, 1));
+}
+
+void test_adam()
+{
+    auto w1 = Variable(af::constant(1, 5), true);
+    auto w2 = Variable(af::constant(1, 5), true);
+    auto x = Variable(af::randu(5) + 1, false);
+    af::optim::AdamOptimizer optim(std::vector<Variable>{w1, w2}, 0.1);
+
+    // The bias correction of the first step makes every parameter move by the learning rate.
+    sum(w1 * x + w2 * x, {0}).backward();
+    optim.update();
+    VERIFY(w1.array() - 0.9);
+    VERIFY(w2.array() - 0.9);
+}
+
+void test_batched_matmul()
+{
+    auto x = af::randu(3, 4);
+    auto w = Variable(af::randu(5, 3), true);
+    auto v = Variable(af::randu(3, 6), true);
+
+    // Every item of the batch is x, so the gradients of the shared weights are twice those of x alone.
+    auto xb = Variable(af::tile(x, 1, 1, 2), true);
+    auto y = matmul(w, xb);
+    VERIFY(af::constant((double)(y.dims()[2] - 2), 1));
+    y.backward();
+    VERIFY(w.grad().array() - 2 * af::matmulNT(af::constant(1, 5, 4), x));
+    VERIFY(xb.grad().array() - af::tile(af::matmulTN(w.array(), af::constant(1, 5, 4)), 1, 1, 2));
+
+    auto z = matmulTN(xb, v);
+    z.backward();
+    VERIFY(v.grad().array() - 2 * af::matmul(x, af::constant(1, 4, 6)));
+
+    auto a = Variable(af::randu(af::dim4(3, 4, 2)), true);
+    auto b = Variable(af::randu(af::dim4(4, 5, 2)), true);
+    auto c = matmul(a, b);
+    c.backward();
+    VERIFY(af::constant((double)(a.grad().dims() != a.dims()), 1));
+    VERIFY(af::constant((double)(b.grad().dims() != b.dims()), 1));
+}
+
+void test_grad_accumulation()
+{
+    auto x = Variable(af::randu(5), true);
+    auto y = x * 2 + x * 3 + x * x;
+    y.backward();
+    VERIFY(x.grad().array() - 5 - 2 * x.array());
+
+    // A held gradient is not modified by a later backward pass.
+    auto dx = x.grad();
+    af::array prev = dx.array();
+    x.zeroGrad();
+    VERIFY(af::constant(x.isGradAvailable(), 1));
+    (x * 4).backward();
+    VERIFY(x.grad().array() - 4);
+    VERIFY(dx.array() - prev);
+
+    // Without zeroGrad, passes accumulate.
+    (x * 4).backward();
+    VERIFY(x.grad().array() - 8);
+
+    // negate(grad(b)) must not be reused from the cache once more is added to grad(b).
+    auto u = Variable(af::randu(5), true);
+    auto v = Variable(af::randu(5), true);
+    auto a = 1.0 - v;
+    auto b = v - u;
+    (b * 2 + (a + b) * 3).backward();
+    VERIFY(u.grad().array() + 5);
+    VERIFY(v.grad().array() - 2);
+}
+
+void test_fuse()
+{
+    auto x = Variable(af::randu(5) - 0.5, true);
+    auto w = Variable(af::randu(5), true);
+    auto fn = [](const std::vector<Variable> &inputs) {
+        return exp(inputs[0]) * inputs[1] + inputs[0] * inputs[0];
+    };
+
+    auto y = af::autograd::fuse(fn, {x, w});
+    VERIFY(y.array() - fn({x, w}).array());
+
+    auto dx = af::autograd::grad({y}, {x, w}, {}, true);
+    VERIFY(dx[0].array() - (af::exp(x.array()) * w.array() + 2 * x.array()));
+    VERIFY(dx[1].array() - af::exp(x.array()));
+
+    // The gradient is itself a fused node, which can be differentiated again.
+    auto dxdx = af::autograd::grad({dx[0]}, {x, w});
+    VERIFY(dxdx[0].array() - (af::exp(x.array()) * w.array() + 2));
+    VERIFY(dxdx[1].array() - af::exp(x.array()));
+
+    // Every op's derivative matches the unfused graph's.
+    auto all_ops = [](const std::vector<Variable> &inputs) {
+        auto a = inputs[0];
+        auto b = inputs[1];
+        return tanh(a) * sigmoid(b) + sin(a) / (2.0 + cos(b)) - log(1.0 + abs(a)) +
+            reciprocal(b + 3) * negate(a) + max(a, 0.1) + min(b, 0.2) + relu(b) + (a > b) * a;
+    };
+    auto fused = af::autograd::fuse(all_ops, {x, w});
+    auto unfused = all_ops({x, w});
+    VERIFY(fused.array() - unfused.array());
+    auto dfused = af::autograd::grad({fused}, {x, w});
+    auto dunfused = af::autograd::grad({unfused}, {x, w});
+    VERIFY(dfused[0].array() - dunfused[0].array());
+    VERIFY(dfused[1].array() - dunfused[1].array());
+
+    // Traced once, then applied like any op.
+    double alpha = 0.5;
+    af::autograd::FusedFunction fused_elu([alpha](const std::vector<Variable> &inputs) {
+            auto mask = inputs[0] >= 0.0;
+            return mask * inputs[0] + !mask * alpha * (exp(inputs[0]) - 1);
+        }, 1);
+    for (int i = 0; i < 2; i++) {
+        auto z = Variable(af::randu(5, 3) - 0.5, true);
+        auto expected = elu(z, alpha);
+        auto y = fused_elu({z});
+        VERIFY(y.array() - expected.array());
+        y.backward();
+        auto dz = z.grad().array();
+        z.zeroGrad();
+        expected.backward();
+        VERIFY(dz - z.grad().array());
+    }
+
+    // fn may only use elementwise ops on its own inputs.
+    bool threw = false;
+    try {
+        af::autograd::fuse([&w](const std::vector<Variable> &inputs) {
+                return inputs[0] * w;
+            }, {x});
+    } catch (af::exception &ex) {
+        threw = true;
+    }
+    VERIFY(af::constant(!threw, 1));
+}
+
+void test_activations()
+{
+    auto x = Variable(af::randu(5, 3) - 0.5, true);
+    auto w = Variable(af::randu(5), true);
+    af::array neg = x.array() < 0;
+
+    relu(x).backward();
+    VERIFY(x.grad().array() - !neg);
+
+    x.zeroGrad();
+    leakyRelu(x, 0.1).backward();
+    VERIFY(x.grad().array() - (!neg + 0.1 * neg));
+
+    x.zeroGrad();
+    auto y = prelu(x, w);
+    VERIFY(y.array() - (x.array() * !neg + af::tile(w.array(), 1, 3) * x.array() * neg));
+    y.backward();
+    VERIFY(x.grad().array() - (!neg + af::tile(w.array(), 1, 3) * neg));
+    VERIFY(w.grad().array() - af::sum(x.array() * neg, 1));
+
+    x.zeroGrad();
+    elu(x, 2.0).backward();
+    VERIFY(x.grad().array() - (!neg + 2.0 * af::exp(x.array()) * neg));
+
+    x.zeroGrad();
+    auto z = threshold(x, 0.2);
+    VERIFY(z.array() - x.array() * (x.array() >= 0.2));
+    z.backward();
+    VERIFY(x.grad().array() - (x.array() >= 0.2));
+}
+
+void test_dropout()
+{
+    auto x = Variable(af::randu(100) + 1, true);
+    auto y = dropout(x, 0.25);
+
+    // Kept elements are scaled by 1 / (1 - 0.25).
+    af::array kept = y.array() != 0;
+    VERIFY(y.array() - kept * x.array() / 0.75);
+
+    // Backward regenerates the same mask.
+    y.backward();
+    VERIFY(x.grad().array() - kept / 0.75);
+
+    // Resetting the seed draws the same masks again.
+    af::setSeed(7);
+    auto first = dropout(x, 0.5).array();
+    af::setSeed(7);
+    VERIFY(dropout(x, 0.5).array() - first);
+}
+
+void test_reductions()
+{
+    auto x = Variable(af::randu(af::dim4(4, 3, 2)), true);
+    af::array y = af::moddims(x.array(), af::dim4(12, 2));
+
+    auto s = sum(x, {0, 1});
+    VERIFY(af::constant((double)(s.dims() != af::dim4(1, 1, 2)), 1));
+    VERIFY(af::flat(s.array()) - af::flat(af::sum(y, 0)));
+
+    auto v = var(x, {0, 1});
+    v.backward();
+    af::array centered = y - af::tile(af::mean(y, 0), 12);
+    VERIFY(af::flat(v.array()) - af::flat(af::sum(centered * centered, 0) / 11));
+    VERIFY(af::flat(x.grad().array()) - af::flat(2 * centered / 11));
+
+    x.zeroGrad();
+    auto m = max(x, {0});
+    m.backward();
+    VERIFY(m.array() - af::max(x.array(), 0));
+    VERIFY(x.grad().array() - (x.array() == af::tile(m.array(), 4)));
+
+    // Tied maxima share the gradient.
+    auto c = Variable(af::constant(1, 4, 2), true);
+    max(c, {0}).backward();
+    VERIFY(c.grad().array() - 0.25);
+
+    x.zeroGrad();
+    auto l = logsumexp(x, {0, 2});
+    l.backward();
+    af::array e = af::exp(x.array());
+    VERIFY(l.array() - af::log(af::sum(af::sum(e, 0), 2)));
+    VERIFY(x.grad().array() - e / af::tile(af::sum(af::sum(e, 0), 2), 4, 1, 2));
+}
+
+void test_released_graph()
+{
+    auto x = Variable(af::randu(5), true);
+    auto h = tanh(x);
+    auto a = h * 2;
+    auto b = h * 3;
+    a.backward();
+
+    // b's graph went through h, which the first pass freed.
+    bool threw = false;
+    try {
+        b.backward();
+    } catch (af::exception &ex) {
+        threw = true;
+    }
+    VERIFY(af::constant(!threw, 1));
+
+    // h may still be used, e.g. for logging, as long as no backward pass reaches it.
+    auto c = mean(h * x, {0});
+    threw = false;
+    try {
+        c.backward();
+    } catch (af::exception &ex) {
+        threw = true;
+    }
+    VERIFY(af::constant(!threw, 1));
+
+    // A detached Variable starts a new graph.
+    h.setCalcGrad(false);
+    x.zeroGrad();
+    (h * x).backward();
+    VERIFY(x.grad().array() - h.array());
+}
+
 int main()
 {
     af::info();
@@ -179,11 +758,33 @@ int main()
     test_multiply_sub();
     test_divide_add();
     test_multiply_add_scalar();
+    test_scalar_ops();
     test_exp();
+    test_reciprocal();
     test_sigmoid();
     test_tanh();
     test_tile();
+    test_broadcast();
     test_sum();
     test_mean();
+    test_no_grad_guard();
+    test_checkpoint();
+    test_tape();
+    test_grad();
+    test_multi_root_backward();
+    test_parallel_backward();
+    test_grad_hook();
+    test_profiler();
+    test_memory_tracker();
+    test_backward_cache();
+    test_mixed_precision();
+    test_adam();
+    test_batched_matmul();
+    test_grad_accumulation();
+    test_fuse();
+    test_activations();
+    test_dropout();
+    test_reductions();
+    test_released_graph();
     return 0;
 }
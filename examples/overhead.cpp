@@ -0,0 +1,59 @@
+/*******************************************************
+ * Copyright (c) 2017, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+
+// Measures the host side cost of building and differentiating autograd nodes.
+// The arrays are tiny so that the time is dominated by graph bookkeeping.
+
+#include <af/autograd.h>
+
+#include <chrono>
+#include <cstdio>
+
+using af::autograd::Variable;
+
+typedef std::chrono::high_resolution_clock Clock;
+
+static double elapsedNs(Clock::time_point start, Clock::time_point stop)
+{
+    return std::chrono::duration<double, std::nano>(stop - start).count();
+}
+
+int main()
+{
+    const int num_ops = 1000;
+    const int iterations = 100;
+
+    af::info();
+
+    auto x = Variable(af::randu(4), true);
+    auto y = Variable(af::randu(4), true);
+    af::eval(x.array(), y.array());
+
+    double forward_ns = 0;
+    double backward_ns = 0;
+    for (int i = 0; i < iterations; i++) {
+        auto start = Clock::now();
+        Variable z = x;
+        for (int j = 0; j < num_ops; j++) {
+            z = (j % 2) ? z * y : z + y;
+        }
+        auto mid = Clock::now();
+        z.backward();
+        auto stop = Clock::now();
+
+        x.zeroGrad();
+        y.zeroGrad();
+        forward_ns += elapsedNs(start, mid);
+        backward_ns += elapsedNs(mid, stop);
+    }
+
+    printf("forward  : %8.1f ns / op\n", forward_ns / (iterations * num_ops));
+    printf("backward : %8.1f ns / op\n", backward_ns / (iterations * num_ops));
+    return 0;
+}
@@ -22,6 +22,7 @@ int main(int argc, const char **args)
 {
     int optim_mode = 0;
     std::string optimizer_arg = std::string(args[1]);
+    bool fp16 = argc > 2 && std::string(args[2]) == "--fp16";
     if (optimizer_arg == "--adam") {
         optim_mode = 1;
     } else if (optimizer_arg == "--rmsprop") {
@@ -54,6 +55,13 @@ int main(int argc, const char **args)
 
     auto loss = nn::MeanSquaredError();
 
+    if (fp16) {
+        // Compute in f16, the optimizer keeps f32 master copies of the weights.
+        model.cast(f16);
+        in = in.as(f16);
+        out = out.as(f16);
+    }
+
     std::unique_ptr<optim::Optimizer> optim;
 
     if (optimizer_arg == "--rmsprop") {
@@ -64,6 +72,8 @@ int main(int argc, const char **args)
         optim = std::unique_ptr<optim::Optimizer>(new optim::SGDOptimizer(model.parameters(), lr, mu));
     }
 
+    if (fp16) optim->setLossScaling();
+
     Variable result, l;
     for (int i = 0; i < 1000; i++) {
         for (int j = 0; j < numSamples; j++) {
@@ -81,7 +91,7 @@ int main(int argc, const char **args)
             l = loss(result, nn::noGrad(out_j));
 
             // Backward propagation
-            l.backward();
+            optim->scaleLoss(l).backward();
 
             // Update parameters
             optim->update();
@@ -89,6 +99,7 @@ int main(int argc, const char **args)
 
         if ((i + 1) % 100 == 0) {
             model.eval();
+            NoGradGuard guard;
 
             // Forward propagation
             result = model(nn::input(in));
@@ -96,7 +107,7 @@ int main(int argc, const char **args)
             // Calculate loss
             // TODO: Use loss function
             af::array diff = out - result.array();
-            printf("Average Error at iteration(%d) : %lf\n", i + 1, af::mean<float>(af::abs(diff)));
+            printf("Average Error at iteration(%d) : %lf\n", i + 1, af::mean<float>(af::abs(diff.as(f32))));
             printf("Predicted\n");
             af_print(result.array());
             printf("Expected\n");
@@ -7,4 +7,8 @@
  * http://arrayfire.com/licenses/BSD-3-Clause
  ********************************************************/
 #include <af/autograd/Variable.hpp>
+#include <af/autograd/BackwardCache.hpp>
 #include <af/autograd/Functions.hpp>
+#include <af/autograd/MemoryTracker.hpp>
+#include <af/autograd/Profiler.hpp>
+#include <af/autograd/Tape.hpp>
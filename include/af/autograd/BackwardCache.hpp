@@ -0,0 +1,78 @@
+/*******************************************************
+ * Copyright (c) 2017, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+#pragma once
+
+#include <af/autograd/Variable.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+
+namespace af {
+    namespace autograd {
+
+        // Shares the tensors that grad functions derive from the same node within one
+        // backward pass, e.g. reciprocal(inputs[1]) in the backward of every division by
+        // the same Variable. When the gradient graph is retained, repeated ops become a
+        // single node, so the backward graph is smaller to differentiate again.
+        class BackwardCache
+        {
+        public:
+            // Caches ops run on the current thread for the lifetime of the object. Unless the
+            // gradient graph is retained, only results that hold no graph are cached, so that
+            // graphs built by grad functions, e.g. when recomputing a checkpoint, are freed.
+            explicit BackwardCache(bool retain_grad_graph);
+
+            ~BackwardCache();
+
+            BackwardCache(const BackwardCache &) = delete;
+            BackwardCache& operator=(const BackwardCache &) = delete;
+
+            // Looks up op applied to input, qualified by dims for ops that depend on a shape.
+            // Returns null on a miss or when no cache is active.
+            static const Variable *find(const char *op, const Variable &input,
+                                        const af::dim4 &dims = af::dim4(0, 0, 0, 0));
+
+            // Records result for a later find and returns it.
+            static Variable store(const char *op, const Variable &input, const Variable &result,
+                                  const af::dim4 &dims = af::dim4(0, 0, 0, 0));
+
+        private:
+            struct Key
+            {
+                const char *op;
+                std::ptrdiff_t input;
+                af::dim4 dims;
+
+                bool operator ==(const Key &other) const;
+            };
+
+            struct KeyHash
+            {
+                size_t operator ()(const Key &key) const;
+            };
+
+            struct Entry
+            {
+                // Node ids are addresses: an entry is only valid while its input lives,
+                // and until the input's data is modified in place.
+                std::weak_ptr<Variable::Shared> input;
+                unsigned version;
+                Variable result;
+            };
+
+            void purge();
+
+            BackwardCache *m_prev;
+            bool m_retain_grad_graph;
+            size_t m_purge_size;
+            std::unordered_map<Key, Entry, KeyHash> m_entries;
+        };
+    }
+}
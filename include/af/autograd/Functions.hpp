@@ -9,6 +9,9 @@
 #pragma once
 
 #include <arrayfire.h>
+#include <functional>
+#include <initializer_list>
+#include <memory>
 #include <vector>
 
 namespace af {
@@ -55,6 +58,14 @@ namespace af {
         Variable tanh(const Variable &input);
         Variable sigmoid(const Variable &input);
 
+        Variable relu(const Variable &input);
+        Variable leakyRelu(const Variable &input, double slope);
+        // weight is broadcast along the dimensions in which its size is 1.
+        Variable prelu(const Variable &input, const Variable &weight);
+        Variable elu(const Variable &input, double alpha);
+        // Zeroes the inputs below threshold, passing the others through.
+        Variable threshold(const Variable &input, double threshold);
+
         Variable max(const Variable &lhs, const Variable &rhs);
         Variable max(const Variable &lhs, const double &rhs);
         Variable max(const double &lhs, const Variable &rhs);
@@ -63,14 +74,30 @@ namespace af {
         Variable min(const Variable &lhs, const double &rhs);
         Variable min(const double &lhs, const Variable &rhs);
 
+        // Zeroes each element with probability ratio and scales the others by 1 / (1 - ratio),
+        // so the expected output is the input and nothing needs rescaling at inference. Only
+        // a seed is kept for backward, which regenerates the mask from it. The seed is drawn
+        // from ArrayFire's default random engine, so af::setSeed makes the masks reproducible.
+        Variable dropout(const Variable &input, double ratio);
+
         Variable transpose(const Variable &input);
         Variable tileAs(const Variable &input, const Variable &reference);
         Variable sumAs(const Variable &input, const Variable &reference);
 
         Variable tile(const Variable &input, const std::vector<int> &repeats);
+        // Reductions keep the reduced axes with size 1. Several axes are reduced in one pass
+        // where they are adjacent, or only separated by axes of size 1.
         Variable sum(const Variable &input, const std::vector<int> &axes);
         Variable mean(const Variable &input, const std::vector<int> &axes);
-
+        // Divides by the number of elements reduced, less one unless is_biased is set.
+        Variable var(const Variable &input, const std::vector<int> &axes, bool is_biased = false);
+        Variable max(const Variable &input, const std::vector<int> &axes);
+        // Otherwise max(input, {0}) would be the elementwise max of input and 0.
+        Variable max(const Variable &input, std::initializer_list<int> axes);
+        Variable logsumexp(const Variable &input, const std::vector<int> &axes);
+
+        // Batched over dims 2 and 3. An operand holding a single matrix along
+        // either of them is broadcast across the other operand's batch.
         Variable matmul(const Variable &lhs, const Variable &rhs);
         Variable matmulTN(const Variable &lhs, const Variable &rhs);
         Variable matmulNT(const Variable &lhs, const Variable &rhs);
@@ -79,5 +106,45 @@ namespace af {
 
         Variable flat(const Variable &input);
         Variable moddims(const Variable &input, const dim4 &dims);
+
+        typedef std::function<Variable(const std::vector<Variable> &)> CheckpointFunc_t;
+
+        // Evaluates fn(inputs) without keeping its intermediate results in the graph and
+        // recomputes them when backward reaches the returned node. fn is called with copies
+        // of inputs detached from the graph and must be deterministic, though dropout within
+        // fn draws the same masks when recomputed as it did in forward. Variables that fn
+        // uses without receiving them as inputs (e.g. module parameters, or results of other
+        // ops) must be passed in params so that the node is part of the graph whenever any of
+        // them needs gradients, and so that their gradients are propagated in turn.
+        // Gradients through a checkpoint cannot be differentiated again.
+        Variable checkpoint(const CheckpointFunc_t &fn,
+                            const std::vector<Variable> &inputs,
+                            const std::vector<Variable> &params = {});
+
+        typedef std::function<Variable(const std::vector<Variable> &)> FusedFunc_t;
+
+        struct FusedProgram;
+
+        // Compiles fn, a chain of elementwise ops on num_inputs Variables, into a single graph
+        // node. fn is traced once, on construction: the ops it applies are recorded, and their
+        // derivatives combined symbolically into one expression per input's gradient. Each
+        // call then evaluates its output as one JIT expression, and backward each gradient as
+        // another, saving none of the intermediate results. fn may only apply arithmetic,
+        // comparisons, !, negate, reciprocal, exp, log, sin, cos, tanh, sigmoid, relu, abs and
+        // max or min with a scalar, to the Variables it receives, which must have the same
+        // dims. The gradients are fused nodes as well, and can be differentiated again.
+        class FusedFunction
+        {
+        public:
+            FusedFunction(const FusedFunc_t &fn, size_t num_inputs);
+
+            Variable operator()(const std::vector<Variable> &inputs) const;
+
+        private:
+            std::shared_ptr<const FusedProgram> m_program;
+        };
+
+        // Compiles fn and applies it to inputs. Keep a FusedFunction to trace fn only once.
+        Variable fuse(const FusedFunc_t &fn, const std::vector<Variable> &inputs);
     }
 }
@@ -0,0 +1,78 @@
+/*******************************************************
+ * Copyright (c) 2017, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+#pragma once
+
+#include <arrayfire.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace af {
+    namespace autograd {
+
+        class Variable;
+
+        // Live and peak bytes of the activations created in one module scope.
+        struct MemoryScope;
+
+        struct MemoryReport
+        {
+            struct Module
+            {
+                std::string name;
+                size_t activations;
+                size_t peak_activations;
+            };
+
+            // Outputs of graph nodes, i.e. everything but the leaves.
+            size_t activations;
+            // Gradients held by graph nodes and leaves, parameters included.
+            size_t gradients;
+            size_t parameters;
+            size_t optimizer_state;
+            // Highest activations + gradients since the last reset, plus parameters and optimizer state.
+            size_t peak;
+            // As reported by af::deviceMemInfo for the active device.
+            size_t device_allocated;
+            size_t device_in_use;
+            std::vector<Module> modules;
+
+            std::string str() const;
+        };
+
+        // Accounts for the bytes held by the autograd graph while enabled. Counts are
+        // logical sizes: arrays sharing a buffer, e.g. through moddims, are counted once
+        // per Variable, so they bound the memory used from above.
+        class MemoryTracker
+        {
+        public:
+            static void start();
+
+            static void stop();
+
+            static bool isEnabled();
+
+            // Restarts peak tracking from the bytes currently held.
+            static void resetPeak();
+
+            static MemoryReport report(const std::vector<Variable> &parameters,
+                                       size_t optimizer_state = 0);
+
+        private:
+            friend class Variable;
+
+            static const MemoryScope *currentScope();
+
+            static void addActivation(const MemoryScope *scope, long long bytes);
+
+            static void addGradient(long long bytes);
+        };
+    }
+}
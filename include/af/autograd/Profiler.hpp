@@ -0,0 +1,133 @@
+/*******************************************************
+ * Copyright (c) 2017, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+#pragma once
+
+#include <arrayfire.h>
+
+#include <string>
+#include <vector>
+
+namespace af {
+    namespace autograd {
+
+        class Variable;
+
+        // An op name together with the module scope it was created in.
+        struct ProfileTag;
+
+        // Records the forward ops and backward grad functions of every Variable, grouped by
+        // the module that created them. Disabled by default, in which case each op only
+        // checks a flag.
+        class Profiler
+        {
+        public:
+            struct Event
+            {
+                std::string name;
+                std::string scope;
+                std::string phase;
+                af::dim4 dims;
+                af::dtype type;
+                int thread;
+                double start_us;
+                double host_us;
+                // Equal to host_us unless the profiler synchronizes with the device.
+                double device_us;
+            };
+
+            // With sync_device set, every op's result is evaluated and the device is
+            // synchronized around it, so that device_us covers the op's kernels. This
+            // serializes execution and disables JIT fusion across ops.
+            static void start(bool sync_device = false);
+
+            static void stop();
+
+            static bool isEnabled();
+
+            static void clear();
+
+            static std::vector<Event> events();
+
+            // Writes the events in the Chrome trace format (chrome://tracing, Perfetto).
+            static void exportChromeTrace(const std::string &path);
+
+            // Total and average times per module, op and phase, longest first.
+            static std::string summary();
+
+        private:
+            friend class Variable;
+            friend class MemoryTracker;
+            friend class ProfileScope;
+            friend class ModuleProfileScope;
+
+            static bool isSyncing();
+
+            static const ProfileTag *currentTag();
+
+            static const std::string &currentModule();
+
+            static void recordOutput(const af::array &data);
+        };
+
+        // Profiles the forward op it is declared in. Ops called from within another op,
+        // or from a grad function, are attributed to the outermost one.
+        class ProfileScope
+        {
+        public:
+            explicit ProfileScope(const char *name, bool backward = false);
+
+            // Profiles the grad function of a node created under tag, whose output is data.
+            ProfileScope(const ProfileTag *tag, const af::array &data);
+
+            ~ProfileScope();
+
+            ProfileScope(const ProfileScope &) = delete;
+            ProfileScope& operator=(const ProfileScope &) = delete;
+
+        private:
+            friend class Profiler;
+
+            void begin(const ProfileTag *tag, const char *phase);
+
+            bool m_active;
+            bool m_dims_from_output;
+            const ProfileTag *m_tag;
+            const ProfileTag *m_prev_tag;
+            ProfileScope *m_prev_scope;
+            const char *m_phase;
+            double m_start_us;
+            af::dim4 m_dims;
+            af::dtype m_type;
+        };
+
+        // Groups the ops created in its lifetime under name, nested within enclosing scopes.
+        // Used by both the Profiler and the MemoryTracker.
+        class ModuleProfileScope
+        {
+        public:
+            explicit ModuleProfileScope(const std::string &name);
+
+            // Names the scope after the module's position in its container.
+            explicit ModuleProfileScope(size_t index);
+
+            ~ModuleProfileScope();
+
+            ModuleProfileScope(const ModuleProfileScope &) = delete;
+            ModuleProfileScope& operator=(const ModuleProfileScope &) = delete;
+
+        private:
+            void begin(const std::string &name);
+
+            bool m_active;
+            bool m_record;
+            size_t m_prev_length;
+            double m_start_us;
+        };
+    }
+}
@@ -0,0 +1,99 @@
+/*******************************************************
+ * Copyright (c) 2017, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace af {
+    namespace autograd {
+
+        // Sequence container that keeps up to N elements inline and only
+        // allocates from the heap once it grows beyond that.
+        template<typename T, size_t N>
+        class SmallVector
+        {
+        public:
+            SmallVector() :
+                m_data(reinterpret_cast<T *>(m_inline)),
+                m_size(0),
+                m_capacity(N)
+            {
+            }
+
+            SmallVector(const T *first, const T *last) :
+                SmallVector()
+            {
+                reserve(last - first);
+                for (; first != last; first++) {
+                    new (m_data + m_size++) T(*first);
+                }
+            }
+
+            SmallVector(const SmallVector &) = delete;
+            SmallVector& operator=(const SmallVector &) = delete;
+
+            ~SmallVector()
+            {
+                clear();
+                if (m_data != reinterpret_cast<T *>(m_inline)) {
+                    ::operator delete(m_data);
+                }
+            }
+
+            void reserve(size_t capacity)
+            {
+                if (capacity <= m_capacity) return;
+                T *data = static_cast<T *>(::operator new(capacity * sizeof(T)));
+                for (size_t i = 0; i < m_size; i++) {
+                    new (data + i) T(std::move(m_data[i]));
+                    m_data[i].~T();
+                }
+                if (m_data != reinterpret_cast<T *>(m_inline)) {
+                    ::operator delete(m_data);
+                }
+                m_data = data;
+                m_capacity = capacity;
+            }
+
+            void push_back(const T &value)
+            {
+                if (m_size == m_capacity) reserve(2 * m_capacity);
+                new (m_data + m_size++) T(value);
+            }
+
+            void clear()
+            {
+                for (size_t i = 0; i < m_size; i++) {
+                    m_data[i].~T();
+                }
+                m_size = 0;
+            }
+
+            size_t size() const { return m_size; }
+            bool empty() const { return m_size == 0; }
+
+            T& operator[](size_t i) { return m_data[i]; }
+            const T& operator[](size_t i) const { return m_data[i]; }
+
+            T* begin() { return m_data; }
+            T* end() { return m_data + m_size; }
+            const T* begin() const { return m_data; }
+            const T* end() const { return m_data + m_size; }
+
+        private:
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type m_inline[N];
+            T *m_data;
+            size_t m_size;
+            size_t m_capacity;
+        };
+    }
+}
@@ -0,0 +1,47 @@
+/*******************************************************
+ * Copyright (c) 2017, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+#pragma once
+
+#include <af/autograd/Variable.hpp>
+
+#include <functional>
+#include <vector>
+
+namespace af {
+    namespace autograd {
+
+        // Runs a training step whose graph has the same structure on every call.
+        // The first replay records the nodes the step builds, in the topological
+        // order they are created in, and the parameters it reaches. Later replays
+        // hand those same nodes back to the ops, which refill them with new data
+        // instead of allocating, and back-propagate along the recorded order
+        // without searching the graph. Gradients of intermediate results are
+        // refilled in place as well. The parameters must remain the same Variables
+        // and the step must not run backward itself. The Variables the step
+        // returns, and the results behind them, are overwritten by the next replay.
+        class Tape
+        {
+        public:
+            typedef std::function<Variable(const std::vector<Variable> &)> StepFunc_t;
+
+            Tape(const StepFunc_t &step);
+
+            // Calls the step with inputs wrapped in Variables that do not require
+            // gradients, back-propagates from the returned loss and returns it.
+            Variable replay(const std::vector<af::array> &inputs);
+
+        private:
+            StepFunc_t m_step;
+            bool m_recorded;
+            Variable::DAG_t m_nodes;
+            Variable::DAG_t m_order;
+            Variable::DAG_t m_pass;
+        };
+    }
+}
@@ -10,37 +10,39 @@
 #pragma once
 
 #include <arrayfire.h>
+#include <af/autograd/SmallVector.hpp>
 
+#include <atomic>
 #include <cstddef>
 #include <functional>
+#include <initializer_list>
 #include <memory>
+#include <utility>
 #include <vector>
-#include <unordered_map>
 
 namespace af {
     namespace autograd {
+        class Tape;
+        struct ProfileTag;
+        struct MemoryScope;
+
         class Variable
         {
         public:
-            typedef std::function<void(std::vector<Variable> &, const Variable &)> GradFunc_t;
-            typedef std::unordered_map<std::ptrdiff_t, bool> Cache_t;
+            // Almost every op has at most three inputs, keep those inside the node.
+            typedef SmallVector<Variable, 3> Inputs_t;
+
+            // Called with the node's inputs, the gradient w.r.t. its output and the output itself,
+            // so that backward can reuse forward results instead of recomputing them.
+            typedef std::function<void(Inputs_t &, const Variable &,
+                                       const Variable &)> GradFunc_t;
             typedef std::vector<Variable> DAG_t;
 
+            // Called with a leaf once its gradient is final for the current backward pass.
+            typedef std::function<void(Variable &)> GradHook_t;
+
         private:
-            struct Shared {
-                Shared();
-                Shared(const af::array &data, bool calc_grad);
-                Shared(const af::array &data,
-                       const std::vector<Variable> &inputs,
-                       GradFunc_t grad_func,
-                       bool calc_grad);
-
-                bool m_calc_grad;
-                af::array m_data;
-                std::vector<Variable> m_inputs;
-                std::vector<Variable> m_grads;
-                GradFunc_t m_grad_func;
-            };
+            struct Shared;
 
         public:
 
@@ -49,6 +51,9 @@ namespace af {
             Variable(const af::array &data,
                      const std::vector<Variable> &inputs,
                      GradFunc_t grad_func);
+            Variable(const af::array &data,
+                     std::initializer_list<Variable> inputs,
+                     GradFunc_t grad_func);
 
             af::array& array() const;
 
@@ -72,20 +77,178 @@ namespace af {
 
             void calcGradInputs(bool retain_grad_graph = false);
 
+            // Unless retain_grad_graph is set, the graph is freed as the pass proceeds: the
+            // intermediate Variables it went through can still be used as inputs of new ops,
+            // but backward throws when it reaches one, until detached with setCalcGrad(false).
             void backward(const Variable &grad, bool retain_grad_graph = false);
 
             void backward(bool retain_grad_graph = false);
 
+            // Hooks run during backward as soon as this leaf's gradient is complete, while the
+            // rest of the graph is still being processed, e.g. to start its optimizer update
+            // early. They may run concurrently on different threads when backward is parallel.
+            void registerGradHook(GradHook_t hook);
+
+            void clearGradHooks();
+
         private:
+            friend class Tape;
+            friend class BackwardCache;
+
             void evalGrad(bool retain_grad_graph = false);
 
-            std::vector<Variable>& getInputs() const;
+            void releaseGraph();
+
+            static void checkGraph(const Variable &var);
+
+            void fireGradHooks();
+
+            void profileOutput();
+
+            void trackActivation();
+
+            void trackGrads();
+
+            Inputs_t& getInputs() const;
+
+            friend std::vector<Variable> grad(const std::vector<Variable> &outputs,
+                                              const std::vector<Variable> &inputs,
+                                              const std::vector<Variable> &grad_outputs,
+                                              bool retain_grad_graph);
+
+            friend void backward(const std::vector<Variable> &roots,
+                                 const std::vector<Variable> &grads,
+                                 const std::vector<Variable> &stops,
+                                 bool retain_grad_graph);
+
+            static void build(DAG_t &dag, const Variable &var);
+
+            static void build(DAG_t &dag, const std::vector<Variable> &roots,
+                              const std::vector<Variable> &stops = {});
+
+            static void visit(DAG_t &dag, const Variable &var, unsigned epoch);
+
+            // Unless release_graph is set, the nodes are left as they are for the DAG to be
+            // propagated again (see Tape).
+            static void propagate(DAG_t &dag, bool retain_grad_graph, bool release_graph);
 
-            static void buildSubGraph(Cache_t &cache, DAG_t &dag, const Variable &var);
+            static void propagateParallel(DAG_t &dag, bool retain_grad_graph, bool release_graph,
+                                          int num_threads);
 
-            static DAG_t build(const Variable &var);
+            static void collectLeaves(DAG_t &leaves, const DAG_t &nodes);
+
+            static DAG_t *record(DAG_t *nodes);
+
+            // While nodes is set, ops on this thread take their graph nodes from it, in order,
+            // instead of creating them. Returns how many the previous setting handed out.
+            static size_t replay(const DAG_t *nodes);
+
+            void reuseNode(const af::array &data,
+                           const Variable *first_input,
+                           const Variable *last_input,
+                           GradFunc_t grad_func);
+
+            // Empties the gradient, keeping its node to be refilled in place unless it is shared.
+            void recycleGrad();
+
+            template<typename... Args>
+            static std::shared_ptr<Shared> makeShared(Args &&... args);
+
+            // Wraps an existing node, or none for a node's empty gradient slot.
+            explicit Variable(std::shared_ptr<Shared> shared);
+
+            void accumulateGrad(const Variable &child_grad);
 
             std::shared_ptr<Shared> m_shared;
         };
+
+        struct Variable::Shared {
+            Shared();
+            Shared(const af::array &data, bool calc_grad);
+            Shared(const af::array &data,
+                   const Variable *first_input,
+                   const Variable *last_input,
+                   GradFunc_t grad_func,
+                   bool calc_grad);
+            ~Shared();
+
+            bool hasGrad() const { return m_grad.m_shared && !m_overwrite_grad; }
+
+            bool m_calc_grad;
+            unsigned m_visit_epoch;
+            std::atomic<int> m_pending_consumers;
+            af::array m_data;
+            Inputs_t m_inputs;
+            // Contributions are summed into m_grad as they arrive. Once set, m_grad is kept
+            // across zeroGrad, which only flags it to be overwritten by the next contribution.
+            Variable m_grad;
+            bool m_overwrite_grad;
+            // Set once backward has freed the node's graph, see releaseGraph.
+            bool m_released;
+            // Bumped whenever m_data is modified in place, see accumulateGrad.
+            unsigned m_version;
+            GradFunc_t m_grad_func;
+            std::vector<GradHook_t> m_grad_hooks;
+            const ProfileTag *m_profile_tag;
+            const MemoryScope *m_memory_scope;
+            size_t m_data_bytes;
+            size_t m_grad_bytes;
+        };
+
+        // Back-propagates from several roots at once, seeding each with the matching entry of
+        // grads (ones if empty). Nodes shared between roots are visited once per call. The
+        // graph is freed as in Variable::backward unless retain_grad_graph is set.
+        void backward(const std::vector<Variable> &roots,
+                      const std::vector<Variable> &grads = {},
+                      bool retain_grad_graph = false);
+
+        // As above, but the pass stops at the nodes in stops: they accumulate the gradients
+        // they receive without propagating them, nor is the graph behind them freed, so that
+        // an enclosing backward pass can continue from them.
+        void backward(const std::vector<Variable> &roots,
+                      const std::vector<Variable> &grads,
+                      const std::vector<Variable> &stops,
+                      bool retain_grad_graph);
+
+        // Returns the gradients of outputs w.r.t. inputs, seeding each output with the matching
+        // entry of grad_outputs (ones if empty). Only the part of the graph between outputs and
+        // inputs is traversed. Unlike backward, no Variable's gradient is modified and the graph
+        // is left intact, so it can be called repeatedly or followed by backward.
+        std::vector<Variable> grad(const std::vector<Variable> &outputs,
+                                   const std::vector<Variable> &inputs,
+                                   const std::vector<Variable> &grad_outputs = {},
+                                   bool retain_grad_graph = false);
+
+        // Number of threads backward uses to run independent branches of the graph
+        // concurrently. 1, the default, runs the graph sequentially on the calling thread.
+        void setBackwardThreads(int num_threads);
+
+        int getBackwardThreads();
+
+        bool isGradEnabled();
+
+        void setGradEnabled(bool enabled);
+
+        // Sets whether graphs are built on the current thread, restoring the previous mode when destroyed.
+        class GradModeGuard
+        {
+        public:
+            explicit GradModeGuard(bool enabled);
+            ~GradModeGuard();
+
+            GradModeGuard(const GradModeGuard &) = delete;
+            GradModeGuard& operator=(const GradModeGuard &) = delete;
+
+        private:
+            bool m_prev;
+        };
+
+        // Disables graph construction on the current thread for its lifetime.
+        // Every Variable created in scope holds data only, with no inputs or grad function.
+        class NoGradGuard : public GradModeGuard
+        {
+        public:
+            NoGradGuard();
+        };
     }
 }
@@ -46,10 +46,18 @@ namespace af
 
         class Sequential : public Container
         {
+        private:
+
+            int m_checkpoint_size;
+
         public:
 
             Sequential();
 
+            // Checkpoint every run of segment_size consecutive modules, recomputing
+            // their intermediate outputs during backward. 0 (the default) disables it.
+            void setCheckpointSize(int segment_size);
+
             autograd::Variable forward(const autograd::Variable &input);
         };
     }
@@ -39,6 +39,11 @@ namespace af
 
             void eval();
 
+            // Converts the parameters to type, e.g. f16 for mixed precision training.
+            // Optimizers set up their state from the parameters' type, so they must be
+            // created after the conversion.
+            void cast(af::dtype type);
+
             virtual autograd::Variable forward(const autograd::Variable &input) = 0;
 
             autograd::Variable operator()(const autograd::Variable &input);
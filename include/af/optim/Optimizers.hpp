@@ -12,6 +12,7 @@
 #include <af/autograd/Variable.hpp>
 #include <arrayfire.h>
 
+#include <cstddef>
 #include <vector>
 
 namespace af
@@ -19,17 +20,53 @@ namespace af
     namespace optim
     {
 
+        // Parameters stored as f16 are updated through f32 master copies, and the
+        // optimizer's state is f32 as well, so that small updates are not lost to rounding.
         class Optimizer
         {
         protected:
             std::vector<autograd::Variable> m_parameters;
+
+            // Applies the update rule to every parameter, reading grad(i) into data(i).
+            virtual void step() = 0;
+
+            // The f32 master copy of parameter i if it is f16, its own data otherwise.
+            af::array& data(size_t i);
+
+            // The unscaled gradient of parameter i, in the type of data(i).
+            const af::array& grad(size_t i) const;
+
+        private:
+            std::vector<af::array> m_master;
+            std::vector<af::array> m_grads;
+            bool m_dynamic_scaling;
+            double m_loss_scale;
+            int m_growth_interval;
+            int m_good_steps;
+
         public:
 
             Optimizer(const std::vector<autograd::Variable> &parameters);
 
-            virtual void update() = 0;
+            virtual ~Optimizer() {}
+
+            // Updates the parameters from their gradients. With dynamic loss scaling, a step
+            // whose gradients overflowed is skipped, the scale is halved and false is returned.
+            bool update();
 
             void zeroGrad();
+
+            // Enables dynamic loss scaling, for training in f16. The loss passed to scaleLoss
+            // is multiplied by the scale, which doubles after growth_interval steps without
+            // overflow, so that small gradients do not flush to zero.
+            void setLossScaling(double initial_scale = 65536, int growth_interval = 2000);
+
+            autograd::Variable scaleLoss(const autograd::Variable &loss) const;
+
+            double getLossScale() const;
+
+            // Bytes held by the optimizer's per parameter state, e.g. momentum.
+            virtual size_t stateBytes() const;
         };
 
         class SGDOptimizer : public Optimizer
@@ -44,7 +81,9 @@ namespace af
                          double learning_rate, double momentum = 0,
                          double weight_decay = 0,
                          bool use_nesterov = false);
-            void update();
+            size_t stateBytes() const;
+        protected:
+            void step();
         };
 
         class AdamOptimizer : public Optimizer
@@ -64,7 +103,9 @@ namespace af
                           double beta2 = 0.999,
                           double epsilon = 1E-8,
                           double weight_decay = 0);
-            void update();
+            size_t stateBytes() const;
+        protected:
+            void step();
         };
 
         class RMSPropOptimizer : public Optimizer
@@ -83,7 +124,9 @@ namespace af
                              double epsilon = 1E-8,
                              double weight_decay = 0,
                              bool use_first = false);
-            void update();
+            size_t stateBytes() const;
+        protected:
+            void step();
         };
 
     }
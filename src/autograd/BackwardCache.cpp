@@ -0,0 +1,107 @@
+/*******************************************************
+ * Copyright (c) 2017, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+
+#include <af/autograd/BackwardCache.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+namespace af {
+    namespace autograd {
+
+        namespace
+        {
+            thread_local BackwardCache *t_cache = nullptr;
+
+            const size_t kMinPurgeSize = 64;
+        }
+
+        BackwardCache::BackwardCache(bool retain_grad_graph) :
+            m_prev(t_cache),
+            m_retain_grad_graph(retain_grad_graph),
+            m_purge_size(kMinPurgeSize),
+            m_entries()
+        {
+            t_cache = this;
+        }
+
+        BackwardCache::~BackwardCache()
+        {
+            t_cache = m_prev;
+        }
+
+        bool BackwardCache::Key::operator ==(const Key &other) const
+        {
+            return input == other.input && dims == other.dims &&
+                (op == other.op || std::strcmp(op, other.op) == 0);
+        }
+
+        size_t BackwardCache::KeyHash::operator ()(const Key &key) const
+        {
+            // The same op name may be a distinct literal at each call site, hash its characters.
+            size_t res = std::hash<std::ptrdiff_t>()(key.input);
+            for (const char *c = key.op; *c; c++) {
+                res = res * 31 + *c;
+            }
+            for (int i = 0; i < 4; i++) {
+                res = res * 31 + (size_t)key.dims[i];
+            }
+            return res;
+        }
+
+        const Variable *BackwardCache::find(const char *op, const Variable &input,
+                                            const af::dim4 &dims)
+        {
+            BackwardCache *cache = t_cache;
+            if (!cache) return nullptr;
+
+            auto iter = cache->m_entries.find(Key{op, input.id(), dims});
+            if (iter == cache->m_entries.end()) return nullptr;
+
+            // A different node may since have been allocated at the same address, or a
+            // gradient buffer may since have been accumulated into.
+            if (iter->second.input.lock() != input.m_shared) return nullptr;
+            if (iter->second.version != input.m_shared->m_version) return nullptr;
+
+            // A data-only result would cut a graph being built from input, e.g. when a
+            // checkpoint is recomputed with grad enabled within the pass.
+            const Variable &result = iter->second.result;
+            if (isGradEnabled() && input.isCalcGrad() && !result.isCalcGrad()) return nullptr;
+            return &result;
+        }
+
+        Variable BackwardCache::store(const char *op, const Variable &input, const Variable &result,
+                                      const af::dim4 &dims)
+        {
+            BackwardCache *cache = t_cache;
+            if (!cache) return result;
+            if (!cache->m_retain_grad_graph && result.isCalcGrad()) return result;
+
+            cache->m_entries[Key{op, input.id(), dims}] = Entry{input.m_shared, input.m_shared->m_version, result};
+            if (cache->m_entries.size() >= cache->m_purge_size) cache->purge();
+            return result;
+        }
+
+        void BackwardCache::purge()
+        {
+            // Without a retained graph, nodes are freed as the pass proceeds and so can
+            // the tensors derived from them. Purging when the cache has doubled in size
+            // keeps the cost amortized.
+            for (auto iter = m_entries.begin(); iter != m_entries.end();) {
+                if (iter->second.input.expired()) {
+                    iter = m_entries.erase(iter);
+                } else {
+                    iter++;
+                }
+            }
+            m_purge_size = std::max(kMinPurgeSize, 2 * m_entries.size());
+        }
+    }
+}
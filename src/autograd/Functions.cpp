@@ -8,250 +8,1045 @@
  ********************************************************/
 
 #include <af/autograd/Variable.hpp>
+#include <af/autograd/BackwardCache.hpp>
 #include <af/autograd/Functions.hpp>
+#include <af/autograd/Profiler.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 namespace af {
     namespace autograd {
 
+        namespace
+        {
+            // Applies op to arrays whose dimensions are equal or 1, letting the JIT
+            // broadcast along size 1 dimensions instead of tiling them in memory.
+            af::array broadcast(const af::array &lhs, const af::array &rhs, af::batchFunc_t op)
+            {
+                if (lhs.dims() == rhs.dims()) return op(lhs, rhs);
+                return af::batchFunc(lhs, rhs, op);
+            }
+
+            // Reduces a gradient over the dimensions along which input was broadcast.
+            Variable unbroadcast(const Variable &grad, const Variable &input)
+            {
+                if (grad.dims() == input.dims()) return grad;
+                return sumAs(grad, input);
+            }
+
+            // Multiplies op(lhs) and op(rhs) for every pair of matrices along dims 2 and 3,
+            // broadcasting a side that holds a single matrix along either of them.
+            af::array batchMatmul(const af::array &lhs, const af::array &rhs,
+                                  af::matProp lhs_prop, af::matProp rhs_prop)
+            {
+                dim4 ldims = lhs.dims();
+                dim4 rdims = rhs.dims();
+                if (ldims[2] * ldims[3] == 1 && rdims[2] * rdims[3] == 1) {
+                    return af::matmul(lhs, rhs, lhs_prop, rhs_prop);
+                }
+
+                // A single lhs matrix multiplies the whole batch as one wide matrix.
+                if (ldims[2] * ldims[3] == 1 && rhs_prop == AF_MAT_NONE) {
+                    auto wide = af::moddims(rhs, dim4(rdims[0], rdims[1] * rdims[2] * rdims[3]));
+                    auto result = af::matmul(lhs, wide, lhs_prop, AF_MAT_NONE);
+                    return af::moddims(result, dim4(result.dims(0), rdims[1], rdims[2], rdims[3]));
+                }
+
+                dim4 ltile(1, 1, 1, 1);
+                dim4 rtile(1, 1, 1, 1);
+                for (int i = 2; i < 4; i++) {
+                    if (ldims[i] == rdims[i]) continue;
+                    if (ldims[i] == 1) {
+                        ltile[i] = rdims[i];
+                    } else if (rdims[i] == 1) {
+                        rtile[i] = ldims[i];
+                    } else {
+                        throw af::exception("matmul: Batch dimensions do not match.");
+                    }
+                }
+                return af::matmul(ltile.elements() == 1 ? lhs : af::tile(lhs, ltile),
+                                  rtile.elements() == 1 ? rhs : af::tile(rhs, rtile),
+                                  lhs_prop, rhs_prop);
+            }
+
+            // The sum over the batch of lhs * rhs^T, shaped like input. When input is a single
+            // matrix used by every item, e.g. a weight, folding the batch into the columns
+            // computes it with one GEMM instead of materializing every product.
+            Variable batchSumNT(const Variable &lhs, const Variable &rhs, const Variable &input)
+            {
+                dim4 ldims = lhs.dims();
+                dim4 rdims = rhs.dims();
+                dim4 idims = input.dims();
+                if (idims[2] * idims[3] == 1 && ldims[2] * ldims[3] > 1 &&
+                    ldims[2] == rdims[2] && ldims[3] == rdims[3]) {
+                    return matmulNT(moddims(lhs, dim4(ldims[0], ldims[1] * ldims[2] * ldims[3])),
+                                    moddims(rhs, dim4(rdims[0], rdims[1] * rdims[2] * rdims[3])));
+                }
+                return unbroadcast(matmulNT(lhs, rhs), input);
+            }
+
+            // The dims of input reduced along axes.
+            dim4 reducedDims(const dim4 &idims, const std::vector<int> &axes)
+            {
+                dim4 odims = idims;
+                for (int axis : axes) {
+                    if (axis < 0 || axis > 3) throw af::exception("Reduction axis out of range.");
+                    odims[axis] = 1;
+                }
+                return odims;
+            }
+
+            // Reduces input with op down to odims. Adjacent dims that are both reduced or both
+            // kept are merged by moddims first, which only changes the array's metadata, so that
+            // every run of reduced dims is reduced in a single pass. Dims of size 1 join either.
+            template<typename Op>
+            af::array reduceTo(const af::array &input, const dim4 &odims, Op op)
+            {
+                dim4 idims = input.dims();
+                dim4 merged(1, 1, 1, 1);
+                bool reduced[4];
+                int num_dims = 0;
+                for (int i = 0; i < 4; i++) {
+                    if (idims[i] == 1) continue;
+                    bool reduce = odims[i] != idims[i];
+                    if (num_dims > 0 && reduced[num_dims - 1] == reduce) {
+                        merged[num_dims - 1] *= idims[i];
+                    } else {
+                        merged[num_dims] = idims[i];
+                        reduced[num_dims++] = reduce;
+                    }
+                }
+
+                af::array result = merged == idims ? input : af::moddims(input, merged);
+                for (int i = 0; i < num_dims; i++) {
+                    if (reduced[i]) result = op(result, i);
+                }
+                return result.dims() == odims ? result : af::moddims(result, odims);
+            }
+
+            af::array sumTo(const af::array &input, const dim4 &odims)
+            {
+                return reduceTo(input, odims, [](const af::array &in, int dim) {
+                        return af::sum(in, dim);
+                    });
+            }
+
+            af::array maxTo(const af::array &input, const dim4 &odims)
+            {
+                return reduceTo(input, odims, [](const af::array &in, int dim) {
+                        return af::max(in, dim);
+                    });
+            }
+
+            // Dropout draws each seed from ArrayFire's default random engine, so that
+            // af::setSeed makes its masks reproducible like any af::randu call. Within a
+            // checkpoint, seeds are numbered from the checkpoint's own instead, so that
+            // recomputing it draws the same masks as its forward did.
+            struct DropoutStream
+            {
+                af::array m_seed;
+                unsigned m_calls;
+            };
+
+            thread_local DropoutStream *t_dropout_stream = nullptr;
+
+            af::array nextDropoutSeed()
+            {
+                if (t_dropout_stream) {
+                    return t_dropout_stream->m_seed + 0x9E3779B9u * ++t_dropout_stream->m_calls;
+                }
+                return af::randu(1, u32);
+            }
+
+            class DropoutStreamScope
+            {
+            public:
+                explicit DropoutStreamScope(const af::array &seed) :
+                    m_stream{seed, 0},
+                    m_prev(t_dropout_stream)
+                {
+                    t_dropout_stream = &m_stream;
+                }
+
+                ~DropoutStreamScope()
+                {
+                    t_dropout_stream = m_prev;
+                }
+
+            private:
+                DropoutStream m_stream;
+                DropoutStream *m_prev;
+            };
+
+            // lowbias32 integer hash: https://nullprogram.com/blog/2018/07/31/
+            af::array hash(const af::array &bits)
+            {
+                af::array res = (bits ^ (bits >> 16u)) * 0x7FEB352Du;
+                res = (res ^ (res >> 15u)) * 0x846CA68Bu;
+                return res ^ (res >> 16u);
+            }
+
+            // A counter-based generator: element i is kept when the hash of i and the seed
+            // is at least ratio of the u32 range. It is elementwise and lazy, so drawing the
+            // mask, scaling and multiplying it evaluate as a single JIT kernel, on the device
+            // the seed lives on, without reading the seed back.
+            af::array dropoutMask(const af::dim4 &dims, af::dtype type, double ratio,
+                                  const af::array &seed)
+            {
+                af::array bits = hash(hash(af::iota(dims, af::dim4(1), u32)) ^ af::tile(seed, dims));
+                unsigned threshold = (unsigned)std::min(ratio * 4294967296.0, 4294967295.0);
+                double scale = ratio < 1 ? 1 / (1 - ratio) : 0;
+                return ((bits >= threshold) * scale).as(type);
+            }
+
+            // Runs fn again on copies of the first num_inputs inputs, building its graph this
+            // time, and back-propagates grad_output through it to the inputs. The remaining
+            // inputs are the params fn uses directly: the pass stops at them, and the enclosing
+            // pass continues from them once all their gradients have arrived.
+            void recompute(const CheckpointFunc_t &fn, Variable::Inputs_t &inputs,
+                           size_t num_inputs, const Variable &grad_output,
+                           const af::array &dropout_seed)
+            {
+                std::vector<Variable> detached;
+                detached.reserve(num_inputs);
+                for (size_t i = 0; i < num_inputs; i++) {
+                    detached.push_back(Variable(inputs[i].array(), inputs[i].isCalcGrad()));
+                }
+
+                Variable recomputed;
+                {
+                    GradModeGuard guard(true);
+                    DropoutStreamScope stream(dropout_seed);
+                    recomputed = fn(detached);
+                }
+                if (!recomputed.isCalcGrad()) return;
+                std::vector<Variable> params(inputs.begin() + num_inputs, inputs.end());
+                backward({recomputed}, {grad_output}, params, false);
+
+                for (size_t i = 0; i < num_inputs; i++) {
+                    if (detached[i].isGradAvailable()) {
+                        inputs[i].addGrad(detached[i].grad());
+                    }
+                }
+            }
+
+            // The elementwise ops fuse can capture. Comparisons and ! yield masks, through
+            // which no gradient flows.
+            enum FusedOp
+            {
+                kInput,
+                kAdd, kSub, kMul, kDiv,
+                kAddScalar, kRSubScalar, kMulScalar, kRDivScalar, kMaxScalar, kMinScalar,
+                kNegate, kReciprocal, kExp, kLog, kSin, kCos, kTanh, kSigmoid, kAbs,
+                kGt, kLt, kGe, kLe, kGtScalar, kLtScalar, kGeScalar, kLeScalar, kNot
+            };
+
+            // Operands index earlier nodes of the same program. An input's lhs is instead its
+            // position among the program's inputs, and value holds a scalar operand.
+            struct FusedNode
+            {
+                FusedOp m_op;
+                int m_lhs;
+                int m_rhs;
+                double m_value;
+            };
+
+            // What fuse records while fn runs: the ops, and which node each Variable seen so
+            // far stands for. The Variables are kept alive so that their ids are not reused.
+            struct FusedTrace
+            {
+                std::unordered_map<std::ptrdiff_t, int> m_ids;
+                std::vector<FusedNode> m_nodes;
+                std::vector<Variable> m_vars;
+            };
+
+            thread_local FusedTrace *t_fused_trace = nullptr;
+
+            int tracedNode(const FusedTrace &trace, const Variable &var)
+            {
+                auto iter = trace.m_ids.find(var.id());
+                if (iter == trace.m_ids.end()) {
+                    throw af::exception("fuse: fn may only apply elementwise ops to its inputs.");
+                }
+                return iter->second;
+            }
+
+            // Records result as op applied to lhs, and rhs or value, while fuse traces fn.
+            Variable traced(const Variable &result, FusedOp op, const Variable &lhs,
+                            const Variable *rhs = nullptr, double value = 0)
+            {
+                if (!t_fused_trace) return result;
+                FusedTrace &trace = *t_fused_trace;
+                FusedNode node = {op, tracedNode(trace, lhs), rhs ? tracedNode(trace, *rhs) : -1, value};
+                trace.m_ids[result.id()] = (int)trace.m_nodes.size();
+                trace.m_nodes.push_back(node);
+                trace.m_vars.push_back(result);
+                return result;
+            }
+        }
+
+        struct FusedProgram
+        {
+            std::vector<FusedNode> m_nodes;
+            int m_output;
+            size_t m_num_inputs;
+
+            // The programs computing the gradient w.r.t. each input from the inputs followed
+            // by the gradient of the output, or none where the output does not depend on it.
+            // Derived on first use, from whichever thread runs backward.
+            mutable std::once_flag m_derived;
+            mutable std::vector<std::shared_ptr<const FusedProgram> > m_grads;
+
+            static std::shared_ptr<const FusedProgram> trace(const FusedFunc_t &fn, size_t num_inputs);
+
+            // Keeps only the nodes output depends on.
+            static std::shared_ptr<const FusedProgram> compact(const std::vector<FusedNode> &nodes,
+                                                               int output, size_t num_inputs);
+
+            static Variable apply(const std::shared_ptr<const FusedProgram> &program,
+                                  const std::vector<Variable> &inputs);
+
+            // Builds one lazy expression, which ArrayFire's JIT evaluates as a single kernel.
+            af::array evaluate(const std::vector<af::array> &args) const;
+
+            const std::vector<std::shared_ptr<const FusedProgram> > &gradients() const;
+
+            void derive() const;
+        };
+
+        std::shared_ptr<const FusedProgram> FusedProgram::trace(const FusedFunc_t &fn, size_t num_inputs)
+        {
+            // fn runs on placeholders: its ops only build JIT expressions, none are evaluated.
+            FusedTrace trace;
+            std::vector<Variable> placeholders;
+            for (size_t i = 0; i < num_inputs; i++) {
+                Variable var(af::constant(0, 1), false);
+                trace.m_ids[var.id()] = (int)trace.m_nodes.size();
+                trace.m_nodes.push_back(FusedNode{kInput, (int)i, -1, 0});
+                trace.m_vars.push_back(var);
+                placeholders.push_back(var);
+            }
+
+            Variable output;
+            {
+                NoGradGuard guard;
+                FusedTrace *prev = t_fused_trace;
+                t_fused_trace = &trace;
+                try {
+                    output = fn(placeholders);
+                } catch (...) {
+                    t_fused_trace = prev;
+                    throw;
+                }
+                t_fused_trace = prev;
+            }
+            return compact(trace.m_nodes, tracedNode(trace, output), num_inputs);
+        }
+
+        std::shared_ptr<const FusedProgram> FusedProgram::compact(const std::vector<FusedNode> &nodes,
+                                                                  int output, size_t num_inputs)
+        {
+            // Operands precede their users, so one backward sweep finds every node needed
+            // and one forward sweep renumbers them.
+            std::vector<int> ids(output + 1, -1);
+            ids[output] = 0;
+            for (int i = output; i >= 0; i--) {
+                if (ids[i] < 0 || nodes[i].m_op == kInput) continue;
+                ids[nodes[i].m_lhs] = 0;
+                if (nodes[i].m_rhs >= 0) ids[nodes[i].m_rhs] = 0;
+            }
+
+            auto program = std::make_shared<FusedProgram>();
+            for (int i = 0; i <= output; i++) {
+                if (ids[i] < 0) continue;
+                FusedNode node = nodes[i];
+                if (node.m_op != kInput) {
+                    node.m_lhs = ids[node.m_lhs];
+                    if (node.m_rhs >= 0) node.m_rhs = ids[node.m_rhs];
+                }
+                ids[i] = (int)program->m_nodes.size();
+                program->m_nodes.push_back(node);
+            }
+            program->m_output = (int)program->m_nodes.size() - 1;
+            program->m_num_inputs = num_inputs;
+            return program;
+        }
+
+        af::array FusedProgram::evaluate(const std::vector<af::array> &args) const
+        {
+            std::vector<af::array> values(m_nodes.size());
+            for (size_t i = 0; i < m_nodes.size(); i++) {
+                const FusedNode &node = m_nodes[i];
+                const af::array &lhs = node.m_op == kInput ? args[node.m_lhs] : values[node.m_lhs];
+                const af::array &rhs = node.m_rhs >= 0 ? values[node.m_rhs] : lhs;
+                double value = node.m_value;
+                switch (node.m_op) {
+                case kInput:       values[i] = lhs; break;
+                case kAdd:         values[i] = lhs + rhs; break;
+                case kSub:         values[i] = lhs - rhs; break;
+                case kMul:         values[i] = lhs * rhs; break;
+                case kDiv:         values[i] = lhs / rhs; break;
+                case kAddScalar:   values[i] = lhs + value; break;
+                case kRSubScalar:  values[i] = value - lhs; break;
+                case kMulScalar:   values[i] = lhs * value; break;
+                case kRDivScalar:  values[i] = value / lhs; break;
+                case kMaxScalar:   values[i] = af::max(lhs, value); break;
+                case kMinScalar:   values[i] = af::min(lhs, value); break;
+                case kNegate:      values[i] = 0.0 - lhs; break;
+                case kReciprocal:  values[i] = 1.0 / lhs; break;
+                case kExp:         values[i] = af::exp(lhs); break;
+                case kLog:         values[i] = af::log(lhs); break;
+                case kSin:         values[i] = af::sin(lhs); break;
+                case kCos:         values[i] = af::cos(lhs); break;
+                case kTanh:        values[i] = af::tanh(lhs); break;
+                case kSigmoid:     values[i] = af::sigmoid(lhs); break;
+                case kAbs:         values[i] = af::abs(lhs); break;
+                case kGt:          values[i] = lhs > rhs; break;
+                case kLt:          values[i] = lhs < rhs; break;
+                case kGe:          values[i] = lhs >= rhs; break;
+                case kLe:          values[i] = lhs <= rhs; break;
+                case kGtScalar:    values[i] = lhs > value; break;
+                case kLtScalar:    values[i] = lhs < value; break;
+                case kGeScalar:    values[i] = lhs >= value; break;
+                case kLeScalar:    values[i] = lhs <= value; break;
+                case kNot:         values[i] = !lhs; break;
+                }
+            }
+            return values[m_output];
+        }
+
+        const std::vector<std::shared_ptr<const FusedProgram> > &FusedProgram::gradients() const
+        {
+            std::call_once(m_derived, [this]() { derive(); });
+            return m_grads;
+        }
+
+        void FusedProgram::derive() const
+        {
+            // Reverse accumulation, appending the gradient of every node to a copy of the
+            // program. The gradient of the output is one more input, after fn's own.
+            std::vector<FusedNode> nodes = m_nodes;
+            auto emit = [&nodes](FusedOp op, int lhs, int rhs, double value) {
+                nodes.push_back(FusedNode{op, lhs, rhs, value});
+                return (int)nodes.size() - 1;
+            };
+            auto unary = [&emit](FusedOp op, int lhs) { return emit(op, lhs, -1, 0); };
+            auto binary = [&emit](FusedOp op, int lhs, int rhs) { return emit(op, lhs, rhs, 0); };
+            auto scalar = [&emit](FusedOp op, int lhs, double value) { return emit(op, lhs, -1, value); };
+
+            int num_nodes = (int)m_nodes.size();
+            std::vector<int> grads(num_nodes, -1);
+            auto accumulate = [&grads, &binary](int id, int grad) {
+                grads[id] = grads[id] < 0 ? grad : binary(kAdd, grads[id], grad);
+            };
+            grads[m_output] = unary(kInput, (int)m_num_inputs);
+
+            std::vector<int> inputs(m_num_inputs, -1);
+            for (int i = num_nodes - 1; i >= 0; i--) {
+                FusedNode node = nodes[i];
+                if (node.m_op == kInput) {
+                    inputs[node.m_lhs] = i;
+                    continue;
+                }
+                int grad = grads[i];
+                if (grad < 0) continue;
+
+                int lhs = node.m_lhs;
+                int rhs = node.m_rhs;
+                switch (node.m_op) {
+                case kAdd:
+                    accumulate(lhs, grad);
+                    accumulate(rhs, grad);
+                    break;
+                case kSub:
+                    accumulate(lhs, grad);
+                    accumulate(rhs, unary(kNegate, grad));
+                    break;
+                case kMul:
+                    accumulate(lhs, binary(kMul, grad, rhs));
+                    accumulate(rhs, binary(kMul, grad, lhs));
+                    break;
+                case kDiv: {
+                    // d(a / b) / db = -(a / b) / b
+                    int grad_lhs = binary(kDiv, grad, rhs);
+                    accumulate(lhs, grad_lhs);
+                    accumulate(rhs, unary(kNegate, binary(kMul, grad_lhs, i)));
+                    break;
+                }
+                case kAddScalar:
+                    accumulate(lhs, grad);
+                    break;
+                case kRSubScalar:
+                case kNegate:
+                    accumulate(lhs, unary(kNegate, grad));
+                    break;
+                case kMulScalar:
+                    accumulate(lhs, scalar(kMulScalar, grad, node.m_value));
+                    break;
+                case kRDivScalar:
+                    // d(c / x) = -c / x^2 = -output / x
+                    accumulate(lhs, unary(kNegate, binary(kDiv, binary(kMul, grad, i), lhs)));
+                    break;
+                case kMaxScalar:
+                    accumulate(lhs, binary(kMul, grad, scalar(kGtScalar, lhs, node.m_value)));
+                    break;
+                case kMinScalar:
+                    accumulate(lhs, binary(kMul, grad, scalar(kLtScalar, lhs, node.m_value)));
+                    break;
+                case kReciprocal:
+                    accumulate(lhs, unary(kNegate, binary(kMul, binary(kMul, grad, i), i)));
+                    break;
+                case kExp:
+                    accumulate(lhs, binary(kMul, grad, i));
+                    break;
+                case kLog:
+                    accumulate(lhs, binary(kDiv, grad, lhs));
+                    break;
+                case kSin:
+                    accumulate(lhs, binary(kMul, grad, unary(kCos, lhs)));
+                    break;
+                case kCos:
+                    accumulate(lhs, unary(kNegate, binary(kMul, grad, unary(kSin, lhs))));
+                    break;
+                case kTanh:
+                    accumulate(lhs, binary(kMul, grad, scalar(kRSubScalar, binary(kMul, i, i), 1.0)));
+                    break;
+                case kSigmoid:
+                    accumulate(lhs, binary(kMul, binary(kMul, grad, i), scalar(kRSubScalar, i, 1.0)));
+                    break;
+                case kAbs: {
+                    // The sign of the input, taken as 1 at 0.
+                    int sign = scalar(kAddScalar, scalar(kMulScalar, scalar(kGeScalar, lhs, 0.0), 2.0), -1.0);
+                    accumulate(lhs, binary(kMul, grad, sign));
+                    break;
+                }
+                default:
+                    break;
+                }
+            }
+
+            m_grads.resize(m_num_inputs);
+            for (size_t i = 0; i < m_num_inputs; i++) {
+                if (inputs[i] >= 0 && grads[inputs[i]] >= 0) {
+                    m_grads[i] = compact(nodes, grads[inputs[i]], m_num_inputs + 1);
+                }
+            }
+        }
+
+        Variable FusedProgram::apply(const std::shared_ptr<const FusedProgram> &program,
+                                     const std::vector<Variable> &inputs)
+        {
+            ProfileScope scope("fused");
+            if (inputs.size() != program->m_num_inputs) {
+                throw af::exception("fuse: Expected as many inputs as fn was traced with.");
+            }
+            std::vector<af::array> args;
+            args.reserve(inputs.size());
+            for (const auto &input : inputs) {
+                if (input.dims() != inputs[0].dims()) {
+                    throw af::exception("fuse: Inputs must have the same dims.");
+                }
+                args.push_back(input.array());
+            }
+            auto result = program->evaluate(args);
+
+            auto grad_func = [program](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                       const Variable &output) {
+                const auto &grads = program->gradients();
+                std::vector<Variable> args(inputs.begin(), inputs.end());
+                args.push_back(grad_output);
+
+                // When the gradient graph is retained, each gradient is a fused node of its own.
+                if (isGradEnabled()) {
+                    for (size_t i = 0; i < grads.size(); i++) {
+                        if (grads[i] && inputs[i].isCalcGrad()) {
+                            inputs[i].addGrad(apply(grads[i], args));
+                        }
+                    }
+                    return;
+                }
+
+                std::vector<af::array> arrays;
+                arrays.reserve(args.size());
+                for (const auto &arg : args) {
+                    arrays.push_back(arg.array());
+                }
+                for (size_t i = 0; i < grads.size(); i++) {
+                    if (grads[i] && inputs[i].isCalcGrad()) {
+                        inputs[i].addGrad(Variable(grads[i]->evaluate(arrays), false));
+                    }
+                }
+            };
+            return Variable(result, inputs, grad_func);
+        }
+
+        FusedFunction::FusedFunction(const FusedFunc_t &fn, size_t num_inputs) :
+            m_program(FusedProgram::trace(fn, num_inputs))
+        {
+        }
+
+        Variable FusedFunction::operator()(const std::vector<Variable> &inputs) const
+        {
+            return FusedProgram::apply(m_program, inputs);
+        }
+
         Variable operator +(const Variable &lhs, const Variable &rhs)
         {
-            auto result = lhs.array() + rhs.array();
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
-                inputs[0].addGrad(grad_output);
-                inputs[1].addGrad(grad_output);
+            ProfileScope scope("add");
+            auto result = broadcast(lhs.array(), rhs.array(), af::operator+);
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                if (inputs[0].isCalcGrad()) {
+                    inputs[0].addGrad(unbroadcast(grad_output, inputs[0]));
+                }
+                if (inputs[1].isCalcGrad()) {
+                    inputs[1].addGrad(unbroadcast(grad_output, inputs[1]));
+                }
             };
-            return Variable(result, {lhs, rhs}, grad_func);
+            return traced(Variable(result, {lhs, rhs}, grad_func), kAdd, lhs, &rhs);
         }
 
         Variable operator -(const Variable &lhs, const Variable &rhs)
         {
-            auto result = lhs.array() - rhs.array();
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
-                inputs[0].addGrad(grad_output);
-                inputs[1].addGrad(negate(grad_output));
+            ProfileScope scope("sub");
+            auto result = broadcast(lhs.array(), rhs.array(), af::operator-);
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                if (inputs[0].isCalcGrad()) {
+                    inputs[0].addGrad(unbroadcast(grad_output, inputs[0]));
+                }
+                if (inputs[1].isCalcGrad()) {
+                    inputs[1].addGrad(unbroadcast(negate(grad_output), inputs[1]));
+                }
             };
-            return Variable(result, {lhs, rhs}, grad_func);
+            return traced(Variable(result, {lhs, rhs}, grad_func), kSub, lhs, &rhs);
         }
 
         Variable operator *(const Variable &lhs, const Variable &rhs)
         {
-            auto result = lhs.array() * rhs.array();
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
-                inputs[0].addGrad(grad_output * inputs[1]);
-                inputs[1].addGrad(grad_output * inputs[0]);
+            ProfileScope scope("mul");
+            auto result = broadcast(lhs.array(), rhs.array(), af::operator*);
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                if (inputs[0].isCalcGrad()) {
+                    inputs[0].addGrad(unbroadcast(grad_output * inputs[1], inputs[0]));
+                }
+                if (inputs[1].isCalcGrad()) {
+                    inputs[1].addGrad(unbroadcast(grad_output * inputs[0], inputs[1]));
+                }
             };
-            return Variable(result, {lhs, rhs}, grad_func);
+            return traced(Variable(result, {lhs, rhs}, grad_func), kMul, lhs, &rhs);
         }
 
         Variable operator /(const Variable &lhs, const Variable &rhs)
         {
-            auto result = lhs.array() / rhs.array();
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            ProfileScope scope("div");
+            auto result = broadcast(lhs.array(), rhs.array(), af::operator/);
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 auto inputs_1_rec = reciprocal(inputs[1]);
                 auto grad_input_0 = grad_output * inputs_1_rec;
-                inputs[0].addGrad(grad_input_0);
-                inputs[1].addGrad(grad_input_0 * negate(inputs[0]) * inputs_1_rec);
+                if (inputs[0].isCalcGrad()) {
+                    inputs[0].addGrad(unbroadcast(grad_input_0, inputs[0]));
+                }
+                if (inputs[1].isCalcGrad()) {
+                    inputs[1].addGrad(unbroadcast(grad_input_0 * negate(inputs[0]) * inputs_1_rec, inputs[1]));
+                }
             };
-            return Variable(result, {lhs, rhs}, grad_func);
+            return traced(Variable(result, {lhs, rhs}, grad_func), kDiv, lhs, &rhs);
         }
 
         Variable operator >(const Variable &lhs, const Variable &rhs)
         {
-            auto result = lhs.array() > rhs.array();
-            return Variable(result, false);
+            auto result = broadcast(lhs.array(), rhs.array(), af::operator>);
+            return traced(Variable(result, false), kGt, lhs, &rhs);
         }
 
         Variable operator <(const Variable &lhs, const Variable &rhs)
         {
-            auto result = lhs.array() < rhs.array();
-            return Variable(result, false);
+            auto result = broadcast(lhs.array(), rhs.array(), af::operator<);
+            return traced(Variable(result, false), kLt, lhs, &rhs);
         }
 
         Variable operator >=(const Variable &lhs, const Variable &rhs)
         {
-            auto result = lhs.array() >= rhs.array();
-            return Variable(result, false);
+            auto result = broadcast(lhs.array(), rhs.array(), af::operator>=);
+            return traced(Variable(result, false), kGe, lhs, &rhs);
         }
 
         Variable operator <=(const Variable &lhs, const Variable &rhs)
         {
-            auto result = lhs.array() <= rhs.array();
-            return Variable(result, false);
+            auto result = broadcast(lhs.array(), rhs.array(), af::operator<=);
+            return traced(Variable(result, false), kLe, lhs, &rhs);
+        }
+
+        // Scalar operands stay host values folded into the JIT expression. They
+        // are not wrapped in full size constants and get no node or gradient.
+
+        Variable operator +(const Variable &lhs, const double &rhs_val)
+        {
+            ProfileScope scope("add");
+            auto result = lhs.array() + rhs_val;
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                inputs[0].addGrad(grad_output);
+            };
+            return traced(Variable(result, {lhs}, grad_func), kAddScalar, lhs, nullptr, rhs_val);
         }
 
+        Variable operator +(const double &lhs_val, const Variable &rhs)
+        {
+            return rhs + lhs_val;
+        }
 
+        Variable operator -(const Variable &lhs, const double &rhs_val)
+        {
+            return lhs + (-rhs_val);
+        }
 
-#define INSTANTIATE_OPERATOR(OP)                                        \
+        Variable operator -(const double &lhs_val, const Variable &rhs)
+        {
+            ProfileScope scope("sub");
+            auto result = lhs_val - rhs.array();
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                inputs[0].addGrad(negate(grad_output));
+            };
+            return traced(Variable(result, {rhs}, grad_func), kRSubScalar, rhs, nullptr, lhs_val);
+        }
+
+        Variable operator *(const Variable &lhs, const double &rhs_val)
+        {
+            ProfileScope scope("mul");
+            auto result = lhs.array() * rhs_val;
+            auto grad_func = [rhs_val](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                       const Variable &output) {
+                inputs[0].addGrad(grad_output * rhs_val);
+            };
+            return traced(Variable(result, {lhs}, grad_func), kMulScalar, lhs, nullptr, rhs_val);
+        }
+
+        Variable operator *(const double &lhs_val, const Variable &rhs)
+        {
+            return rhs * lhs_val;
+        }
+
+        Variable operator /(const Variable &lhs, const double &rhs_val)
+        {
+            return lhs * (1.0 / rhs_val);
+        }
+
+        Variable operator /(const double &lhs_val, const Variable &rhs)
+        {
+            ProfileScope scope("div");
+            auto result = lhs_val / rhs.array();
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                // d(c / x) = -c / x^2 = -output / x
+                inputs[0].addGrad(negate(grad_output) * output / inputs[0]);
+            };
+            return traced(Variable(result, {rhs}, grad_func), kRDivScalar, rhs, nullptr, lhs_val);
+        }
+
+        // Traced with the scalar on the right: c OP x is recorded as x SWAPPED c.
+#define INSTANTIATE_COMPARISON(OP, SCALAR_OP, SWAPPED)                  \
         Variable operator OP(const double &lhs_val, const Variable &rhs) \
         {                                                               \
-            auto lhs = Variable(                                        \
-                af::constant(lhs_val,                                   \
-                             rhs.array().dims(),                        \
-                             rhs.array().type()),                       \
-                false);                                                 \
-            return lhs OP rhs;                                          \
+            return traced(Variable(lhs_val OP rhs.array(), false),      \
+                          SWAPPED, rhs, nullptr, lhs_val);              \
         }                                                               \
         Variable operator OP(const Variable &lhs, const double &rhs_val) \
         {                                                               \
-            auto rhs = Variable(                                        \
-                af::constant(rhs_val,                                   \
-                             lhs.array().dims(), lhs.array().type()),   \
-                false);                                                 \
-            return lhs OP rhs;                                          \
+            return traced(Variable(lhs.array() OP rhs_val, false),      \
+                          SCALAR_OP, lhs, nullptr, rhs_val);            \
         }                                                               \
 
-        INSTANTIATE_OPERATOR(+)
-        INSTANTIATE_OPERATOR(-)
-        INSTANTIATE_OPERATOR(*)
-        INSTANTIATE_OPERATOR(/)
-        INSTANTIATE_OPERATOR(>)
-        INSTANTIATE_OPERATOR(<)
-        INSTANTIATE_OPERATOR(>=)
-        INSTANTIATE_OPERATOR(<=)
+        INSTANTIATE_COMPARISON(>, kGtScalar, kLtScalar)
+        INSTANTIATE_COMPARISON(<, kLtScalar, kGtScalar)
+        INSTANTIATE_COMPARISON(>=, kGeScalar, kLeScalar)
+        INSTANTIATE_COMPARISON(<=, kLeScalar, kGeScalar)
 
-#undef INSTANTIATE_OPERATOR
+#undef INSTANTIATE_COMPARISON
 
         Variable operator !(const Variable &input)
         {
             auto result = !input.array();
-            return Variable(result, false);
+            return traced(Variable(result, false), kNot, input);
         }
 
         Variable max(const Variable &lhs, const Variable &rhs)
         {
+            ProfileScope scope("max");
             auto mask = lhs > rhs;
             auto result = max(lhs.array(), rhs.array());
 
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
-                inputs[0].addGrad( inputs[2] * grad_output);
-                inputs[1].addGrad(!inputs[2] * grad_output);
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                if (inputs[0].isCalcGrad()) {
+                    inputs[0].addGrad(inputs[2] * grad_output);
+                }
+                if (inputs[1].isCalcGrad()) {
+                    inputs[1].addGrad(!inputs[2] * grad_output);
+                }
             };
             return Variable(result, {lhs, rhs, mask}, grad_func);
         }
 
         Variable min(const Variable &lhs, const Variable &rhs)
         {
+            ProfileScope scope("min");
             auto mask = lhs < rhs;
             auto result = min(lhs.array(), rhs.array());
 
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
-              inputs[0].addGrad( inputs[2] * grad_output);
-              inputs[1].addGrad(!inputs[2] * grad_output);
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                if (inputs[0].isCalcGrad()) {
+                    inputs[0].addGrad(inputs[2] * grad_output);
+                }
+                if (inputs[1].isCalcGrad()) {
+                    inputs[1].addGrad(!inputs[2] * grad_output);
+                }
             };
             return Variable(result, {lhs, rhs, mask}, grad_func);
         }
 
-#define INSTANTIATE_FUNCTION(FN)                                        \
-        Variable FN(const double &lhs_val, const Variable &rhs)         \
-        {                                                               \
-            auto lhs = Variable(                                        \
-                af::constant(lhs_val,                                   \
-                             rhs.array().dims(),                        \
-                             rhs.array().type()),                       \
-                false);                                                 \
-            return FN(lhs,rhs);                                         \
-        }                                                               \
-        Variable FN(const Variable &lhs, const double &rhs_val)         \
-        {                                                               \
-            auto rhs = Variable(                                        \
-                af::constant(rhs_val,                                   \
-                             lhs.array().dims(), lhs.array().type()),   \
-                false);                                                 \
-            return FN(lhs, rhs);                                        \
+        Variable max(const Variable &lhs, const double &rhs_val)
+        {
+            ProfileScope scope("max");
+            auto result = max(lhs.array(), rhs_val);
+            auto grad_func = [rhs_val](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                       const Variable &output) {
+                inputs[0].addGrad((inputs[0] > rhs_val) * grad_output);
+            };
+            return traced(Variable(result, {lhs}, grad_func), kMaxScalar, lhs, nullptr, rhs_val);
         }
 
+        Variable max(const double &lhs_val, const Variable &rhs)
+        {
+            return max(rhs, lhs_val);
+        }
 
-      INSTANTIATE_FUNCTION(max);
-      INSTANTIATE_FUNCTION(min);
+        Variable min(const Variable &lhs, const double &rhs_val)
+        {
+            ProfileScope scope("min");
+            auto result = min(lhs.array(), rhs_val);
+            auto grad_func = [rhs_val](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                       const Variable &output) {
+                inputs[0].addGrad((inputs[0] < rhs_val) * grad_output);
+            };
+            return traced(Variable(result, {lhs}, grad_func), kMinScalar, lhs, nullptr, rhs_val);
+        }
 
-#undef INSTANTIATE_FUNCTION
+        Variable min(const double &lhs_val, const Variable &rhs)
+        {
+            return min(rhs, lhs_val);
+        }
 
       Variable negate(const Variable &input)
         {
+            ProfileScope scope("negate");
+            if (auto cached = BackwardCache::find("negate", input)) return *cached;
             auto result = 0.0 - input.array();
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 inputs[0].addGrad(negate(grad_output));
             };
-            return Variable(result, {input}, grad_func);
+            return traced(BackwardCache::store("negate", input, Variable(result, {input}, grad_func)),
+                          kNegate, input);
         }
 
         Variable reciprocal(const Variable &input)
         {
+            ProfileScope scope("reciprocal");
+            if (auto cached = BackwardCache::find("reciprocal", input)) return *cached;
             auto result = 1.0 / input.array();
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
-                auto res = reciprocal(inputs[0]);
-                inputs[0].addGrad(negate(grad_output) * res * res);
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                inputs[0].addGrad(negate(grad_output) * output * output);
             };
-            return Variable(result, {input}, grad_func);
+            return traced(BackwardCache::store("reciprocal", input, Variable(result, {input}, grad_func)),
+                          kReciprocal, input);
         }
 
         Variable exp(const Variable &input)
         {
+            ProfileScope scope("exp");
+            if (auto cached = BackwardCache::find("exp", input)) return *cached;
             auto result = exp(input.array());
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
-                inputs[0].addGrad(grad_output * exp(inputs[0]));
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                inputs[0].addGrad(grad_output * output);
             };
-            return Variable(result, {input}, grad_func);
+            return traced(BackwardCache::store("exp", input, Variable(result, {input}, grad_func)),
+                          kExp, input);
         }
 
         Variable log(const Variable &input)
         {
+            ProfileScope scope("log");
+            if (auto cached = BackwardCache::find("log", input)) return *cached;
             auto result = log(input.array());
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 inputs[0].addGrad(grad_output / inputs[0]);
             };
-            return Variable(result, {input}, grad_func);
+            return traced(BackwardCache::store("log", input, Variable(result, {input}, grad_func)),
+                          kLog, input);
         }
 
         Variable sin(const Variable &input)
         {
+            ProfileScope scope("sin");
+            if (auto cached = BackwardCache::find("sin", input)) return *cached;
             auto result = sin(input.array());
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 inputs[0].addGrad(grad_output * cos(inputs[0]));
             };
-            return Variable(result, {input}, grad_func);
+            return traced(BackwardCache::store("sin", input, Variable(result, {input}, grad_func)),
+                          kSin, input);
         }
 
         Variable cos(const Variable &input)
         {
+            ProfileScope scope("cos");
+            if (auto cached = BackwardCache::find("cos", input)) return *cached;
             auto result = cos(input.array());
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 inputs[0].addGrad(grad_output * negate(sin(inputs[0])));
             };
-            return Variable(result, {input}, grad_func);
+            return traced(BackwardCache::store("cos", input, Variable(result, {input}, grad_func)),
+                          kCos, input);
         }
 
         Variable tanh(const Variable &input)
         {
+            ProfileScope scope("tanh");
+            if (auto cached = BackwardCache::find("tanh", input)) return *cached;
             auto result = tanh(input.array());
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
-                auto tmp = tanh(inputs[0]);
-                inputs[0].addGrad(grad_output * (1.0 - tmp * tmp));
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                inputs[0].addGrad(grad_output * (1.0 - output * output));
             };
-            return Variable(result, {input}, grad_func);
+            return traced(BackwardCache::store("tanh", input, Variable(result, {input}, grad_func)),
+                          kTanh, input);
         }
 
         Variable sigmoid(const Variable &input)
         {
+            ProfileScope scope("sigmoid");
+            if (auto cached = BackwardCache::find("sigmoid", input)) return *cached;
             auto result = sigmoid(input.array());
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
-                auto tmp = sigmoid(inputs[0]);
-                inputs[0].addGrad(grad_output * tmp * (1 - tmp));
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                inputs[0].addGrad(grad_output * output * (1 - output));
+            };
+            return traced(BackwardCache::store("sigmoid", input, Variable(result, {input}, grad_func)),
+                          kSigmoid, input);
+        }
+
+        // The activations below keep no mask: backward derives it from the input or the
+        // output, both of which the node holds anyway.
+        Variable relu(const Variable &input)
+        {
+            ProfileScope scope("relu");
+            if (auto cached = BackwardCache::find("relu", input)) return *cached;
+            auto result = max(input.array(), 0.0);
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                inputs[0].addGrad((output > 0.0) * grad_output);
+            };
+            return traced(BackwardCache::store("relu", input, Variable(result, {input}, grad_func)),
+                          kMaxScalar, input, nullptr, 0.0);
+        }
+
+        Variable leakyRelu(const Variable &input, double slope)
+        {
+            ProfileScope scope("leakyRelu");
+            auto result = af::select(input.array() >= 0.0, input.array(), slope * input.array());
+            auto grad_func = [slope](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                     const Variable &output) {
+                inputs[0].addGrad(((inputs[0] >= 0.0) * (1 - slope) + slope) * grad_output);
+            };
+            return Variable(result, {input}, grad_func);
+        }
+
+        Variable prelu(const Variable &input, const Variable &weight)
+        {
+            ProfileScope scope("prelu");
+            auto result = af::select(input.array() >= 0.0, input.array(),
+                                     broadcast(input.array(), weight.array(), af::operator*));
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                auto negative = inputs[0] < 0.0;
+                if (inputs[0].isCalcGrad()) {
+                    inputs[0].addGrad((!negative + negative * inputs[1]) * grad_output);
+                }
+                if (inputs[1].isCalcGrad()) {
+                    inputs[1].addGrad(unbroadcast(negative * inputs[0] * grad_output, inputs[1]));
+                }
+            };
+            return Variable(result, {input, weight}, grad_func);
+        }
+
+        Variable elu(const Variable &input, double alpha)
+        {
+            ProfileScope scope("elu");
+            auto result = af::select(input.array() >= 0.0, input.array(),
+                                     alpha * (af::exp(input.array()) - 1));
+            auto grad_func = [alpha](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                     const Variable &output) {
+                // For negative inputs, the derivative alpha * exp(x) is output + alpha.
+                auto mask = inputs[0] >= 0.0;
+                inputs[0].addGrad((mask + !mask * (output + alpha)) * grad_output);
+            };
+            return Variable(result, {input}, grad_func);
+        }
+
+        Variable threshold(const Variable &input, double threshold)
+        {
+            ProfileScope scope("threshold");
+            auto result = af::select(input.array() >= threshold, input.array(), 0.0);
+            auto grad_func = [threshold](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                         const Variable &output) {
+                inputs[0].addGrad((inputs[0] >= threshold) * grad_output);
+            };
+            return Variable(result, {input}, grad_func);
+        }
+
+        Variable dropout(const Variable &input, double ratio)
+        {
+            ProfileScope scope("dropout");
+            af::array seed = nextDropoutSeed();
+            auto result = input.array() * dropoutMask(input.dims(), input.type(), ratio, seed);
+            auto grad_func = [ratio, seed](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                           const Variable &output) {
+                auto mask = dropoutMask(output.dims(), output.type(), ratio, seed);
+                inputs[0].addGrad(grad_output * Variable(mask, false));
             };
             return Variable(result, {input}, grad_func);
         }
 
         Variable transpose(const Variable &input)
         {
+            ProfileScope scope("transpose");
+            if (auto cached = BackwardCache::find("transpose", input)) return *cached;
             auto result = transpose(input.array());
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 inputs[0].addGrad(transpose(grad_output));
             };
-            return Variable(result, {input}, grad_func);
+            return BackwardCache::store("transpose", input, Variable(result, {input}, grad_func));
         }
 
         Variable tileAs(const Variable &input, const Variable &reference)
         {
+            ProfileScope scope("tileAs");
+            if (auto cached = BackwardCache::find("tileAs", input, reference.dims())) return *cached;
             dim4 dims(1,1,1,1);
             dim4 rdims = reference.dims();
             dim4 idims = input.dims();
@@ -259,34 +1054,35 @@ namespace af {
                 dims[i] = rdims[i] / idims[i];
             }
             auto result = tile(input.array(), dims);
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 inputs[0].addGrad(sumAs(grad_output, inputs[0]));
             };
-            return Variable(result, {input}, grad_func);
+            return BackwardCache::store("tileAs", input, Variable(result, {input}, grad_func), reference.dims());
         }
 
         Variable sumAs(const Variable &input, const Variable &reference)
         {
-            dim4 rdims = reference.dims();
-            dim4 idims = input.dims();
-            auto result = input.array();
-            for (int i = 0; i < 4; i++) {
-                if (idims[i] != rdims[i]) result = sum(result, i);
-            }
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            ProfileScope scope("sumAs");
+            if (auto cached = BackwardCache::find("sumAs", input, reference.dims())) return *cached;
+            auto result = sumTo(input.array(), reference.dims());
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 inputs[0].addGrad(tileAs(grad_output, inputs[0]));
             };
-            return Variable(result, {input}, grad_func);
+            return BackwardCache::store("sumAs", input, Variable(result, {input}, grad_func), reference.dims());
         }
 
         Variable tile(const Variable &input, const std::vector<int> &repeats)
         {
+            ProfileScope scope("tile");
             dim4 dims;
             for (size_t i = 0; i < repeats.size(); i++) {
                 dims[i] = repeats[i];
             }
             auto result = tile(input.array(), dims);
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 inputs[0].addGrad(sumAs(grad_output, inputs[0]));
             };
             return Variable(result, {input}, grad_func);
@@ -294,11 +1090,10 @@ namespace af {
 
         Variable sum(const Variable &input, const std::vector<int> &axes)
         {
-            auto result = input.array();
-            for (size_t i = 0; i < axes.size(); i++) {
-                result = sum(result, axes[i]);
-            }
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            ProfileScope scope("sum");
+            auto result = sumTo(input.array(), reducedDims(input.dims(), axes));
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 inputs[0].addGrad(tileAs(grad_output, inputs[0]));
             };
             return Variable(result, {input}, grad_func);
@@ -306,101 +1101,178 @@ namespace af {
 
         Variable mean(const Variable &input, const std::vector<int> &axes)
         {
-            auto result = input.array();
-            for (size_t i = 0; i < axes.size(); i++) {
-                result = mean(result, axes[i]);
-            }
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
-                dim4 odims = grad_output.dims();
-                dim4 idims = inputs[0].dims();
-                dim_t count = 1;
-                for (int i = 0; i < 4; i++) {
-                    count *= idims[i] / odims[i];
-                }
-                inputs[0].addGrad(count * tileAs(grad_output, inputs[0]));
+            ProfileScope scope("mean");
+            dim4 odims = reducedDims(input.dims(), axes);
+            double count = (double)input.dims().elements() / odims.elements();
+            auto result = sumTo(input.array(), odims) / count;
+            auto grad_func = [count](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                     const Variable &output) {
+                // Scaled before it is tiled, on the reduced size.
+                inputs[0].addGrad(tileAs(grad_output / count, inputs[0]));
+            };
+            return Variable(result, {input}, grad_func);
+        }
+
+        Variable var(const Variable &input, const std::vector<int> &axes, bool is_biased)
+        {
+            ProfileScope scope("var");
+            dim4 odims = reducedDims(input.dims(), axes);
+            double count = (double)input.dims().elements() / odims.elements();
+            double denom = is_biased || count == 1 ? count : count - 1;
+
+            auto centered = broadcast(input.array(), sumTo(input.array(), odims) / count,
+                                      af::operator-);
+            auto result = sumTo(centered * centered, odims) / denom;
+            auto grad_func = [axes, denom](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                           const Variable &output) {
+                // The mean is recomputed, rather than kept, and broadcast against the input.
+                auto centered = inputs[0] - mean(inputs[0], axes);
+                inputs[0].addGrad(centered * grad_output * (2 / denom));
+            };
+            return Variable(result, {input}, grad_func);
+        }
+
+        Variable max(const Variable &input, const std::vector<int> &axes)
+        {
+            ProfileScope scope("max");
+            auto result = maxTo(input.array(), reducedDims(input.dims(), axes));
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                // Ties share the gradient equally, so that it still sums to grad_output.
+                auto mask = broadcast(inputs[0].array(), output.array(), af::operator==);
+                auto ties = sumTo(mask, output.dims());
+                auto share = broadcast(mask.as(output.type()), ties, af::operator/);
+                inputs[0].addGrad(Variable(share, false) * grad_output);
+            };
+            return Variable(result, {input}, grad_func);
+        }
+
+        Variable max(const Variable &input, std::initializer_list<int> axes)
+        {
+            return max(input, std::vector<int>(axes));
+        }
+
+        Variable logsumexp(const Variable &input, const std::vector<int> &axes)
+        {
+            ProfileScope scope("logsumexp");
+            dim4 odims = reducedDims(input.dims(), axes);
+
+            // Shifted by the maximum so that exp cannot overflow.
+            auto shift = maxTo(input.array(), odims);
+            auto shifted = af::exp(broadcast(input.array(), shift, af::operator-));
+            auto result = shift + af::log(sumTo(shifted, odims));
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
+                inputs[0].addGrad(exp(inputs[0] - output) * grad_output);
             };
             return Variable(result, {input}, grad_func);
         }
 
         Variable matmul(const Variable &lhs, const Variable &rhs)
         {
+            ProfileScope scope("matmul");
+            // Every dim below may carry batch dims 2 and 3 as well,
+            // whose gradients are summed where an input was broadcast.
             // lhs:Input[0] -- [M, N]
             // rhs:Input[1] -- [N, K]
             //matmul(lhs, rhs)
             // -- matmul([M, N], [N, K]) --  [M, K]
             // result:grad_output -- [M, K]
-            auto result = matmul(lhs.array(), rhs.array());
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            auto result = batchMatmul(lhs.array(), rhs.array(), AF_MAT_NONE, AF_MAT_NONE);
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 // matmulNT(grad_output, inputs[1])
                 // -- matmulNT([M, K], [N, K])
                 // -- matmul([M, K], [K, N]) -- [M, K]
-                inputs[0].addGrad(matmulNT(grad_output, inputs[1]));
+                if (inputs[0].isCalcGrad()) {
+                    inputs[0].addGrad(batchSumNT(grad_output, inputs[1], inputs[0]));
+                }
                 // matmulTN(inputs[0], grad_output)
                 // -- matmulTN([M, N], [M, K])
                 // -- matmul([N, M], [M, K]) -- [N, K]
-                inputs[1].addGrad(matmulTN(inputs[0], grad_output));
+                if (inputs[1].isCalcGrad()) {
+                    inputs[1].addGrad(unbroadcast(matmulTN(inputs[0], grad_output), inputs[1]));
+                }
             };
             return Variable(result, {lhs, rhs}, grad_func);
         }
 
         Variable matmulTN(const Variable &lhs, const Variable &rhs)
         {
+            ProfileScope scope("matmulTN");
             // lhs:Input[0] -- [N, M]
             // rhs:Input[1] -- [N, K]
             // matmulTN(lhs, rhs)
             // -- matmulTN([N, M], [N, K])
             // -- matmul([M, N], [N, K]) -- [M, K]
             // result:grad_output -- [M, K]
-            auto result = matmulTN(lhs.array(), rhs.array());
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            auto result = batchMatmul(lhs.array(), rhs.array(), AF_MAT_TRANS, AF_MAT_NONE);
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 // matmulNT(inputs[1], grad_output)
                 // -- matmulNT([N, K], [M, K])
                 // -- matmul([N, K], [K, M]) -- [N, M]
-                inputs[0].addGrad(matmulNT(inputs[1], grad_output));
+                if (inputs[0].isCalcGrad()) {
+                    inputs[0].addGrad(batchSumNT(inputs[1], grad_output, inputs[0]));
+                }
                 // matmul(inputs[0], grad_output)
                 // -- matmulNT([N, M], [M, K]) -- [N, K]
-                inputs[1].addGrad(matmul(inputs[0], grad_output));
+                if (inputs[1].isCalcGrad()) {
+                    inputs[1].addGrad(unbroadcast(matmul(inputs[0], grad_output), inputs[1]));
+                }
             };
             return Variable(result, {lhs, rhs}, grad_func);
         }
 
         Variable matmulNT(const Variable &lhs, const Variable &rhs)
         {
+            ProfileScope scope("matmulNT");
             // lhs:Input[0] -- [M, N]
             // rhs:Input[1] -- [K, N]
             // matmulNT(lhs, rhs)
             // -- matmulNT([M, N], [K, N])
             // -- matmul([M, N], [N, K]) -- [M, K]
             // result:grad_output -- [M, K]
-            auto result = matmulNT(lhs.array(), rhs.array());
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            auto result = batchMatmul(lhs.array(), rhs.array(), AF_MAT_NONE, AF_MAT_TRANS);
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 // matmul(grad_output, inputs[1])
                 // -- matmul([M, K], [K, N]) -- [M, N]
-                inputs[0].addGrad(matmul(grad_output, inputs[1]));
+                if (inputs[0].isCalcGrad()) {
+                    inputs[0].addGrad(unbroadcast(matmul(grad_output, inputs[1]), inputs[0]));
+                }
                 // matmulTN(grad_output, inputs[0])
                 // -- matmulTN([M, K], [M, N])
                 // -- matmul([K, M], [M, N]) -- [K, N]
-                inputs[1].addGrad(matmulTN(grad_output, inputs[0]));
+                if (inputs[1].isCalcGrad()) {
+                    inputs[1].addGrad(unbroadcast(matmulTN(grad_output, inputs[0]), inputs[1]));
+                }
             };
             return Variable(result, {lhs, rhs}, grad_func);
         }
 
         Variable abs(const Variable &input)
         {
+            ProfileScope scope("abs");
+            if (auto cached = BackwardCache::find("abs", input)) return *cached;
             auto result = af::abs(input.array());
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 // af::sign returns signbit
                 // Convert it into -1, 1
                 auto sign = Variable(1 - 2 * af::sign(inputs[0].array()), false);
                 inputs[0].addGrad(sign * grad_output);
             };
-            return Variable(result, {input}, grad_func);
+            return traced(BackwardCache::store("abs", input, Variable(result, {input}, grad_func)),
+                          kAbs, input);
         }
 
         Variable flat(const Variable &input)
         {
+            ProfileScope scope("flat");
             auto result = af::flat(input.array());
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 inputs[0].addGrad(moddims(grad_output, inputs[0].dims()));
             };
             return Variable(result, {input}, grad_func);
@@ -408,11 +1280,45 @@ namespace af {
 
         Variable moddims(const Variable &input, const dim4 &dims)
         {
+            ProfileScope scope("moddims");
             auto result = af::moddims(input.array(), dims);
-            auto grad_func = [](std::vector<Variable> &inputs, const Variable &grad_output) {
+            auto grad_func = [](Variable::Inputs_t &inputs, const Variable &grad_output,
+                                const Variable &output) {
                 inputs[0].addGrad(moddims(grad_output, inputs[0].dims()));
             };
             return Variable(result, {input}, grad_func);
         }
+
+        Variable checkpoint(const CheckpointFunc_t &fn,
+                            const std::vector<Variable> &inputs,
+                            const std::vector<Variable> &params)
+        {
+            ProfileScope scope("checkpoint");
+            af::array dropout_seed = nextDropoutSeed();
+            af::array result;
+            {
+                NoGradGuard guard;
+                DropoutStreamScope stream(dropout_seed);
+                result = fn(inputs).array();
+            }
+
+            // The node depends on params to order it before them in backward; the recomputed
+            // graph uses them directly and adds their gradients itself.
+            size_t num_inputs = inputs.size();
+            std::vector<Variable> node_inputs(inputs.begin(), inputs.end());
+            node_inputs.insert(node_inputs.end(), params.begin(), params.end());
+
+            auto grad_func = [fn, num_inputs, dropout_seed](Variable::Inputs_t &inputs,
+                                                            const Variable &grad_output,
+                                                            const Variable &output) {
+                recompute(fn, inputs, num_inputs, grad_output, dropout_seed);
+            };
+            return Variable(result, node_inputs, grad_func);
+        }
+
+        Variable fuse(const FusedFunc_t &fn, const std::vector<Variable> &inputs)
+        {
+            return FusedFunction(fn, inputs.size())(inputs);
+        }
     }
 }
@@ -0,0 +1,181 @@
+/*******************************************************
+ * Copyright (c) 2017, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+
+#include <af/autograd/MemoryTracker.hpp>
+#include <af/autograd/Profiler.hpp>
+#include <af/autograd/Variable.hpp>
+
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+
+namespace af {
+    namespace autograd {
+
+        struct MemoryScope
+        {
+            std::string name;
+            std::atomic<long long> live;
+            std::atomic<long long> peak;
+        };
+
+        namespace
+        {
+            std::atomic<bool> g_enabled(false);
+
+            std::atomic<long long> g_activations(0);
+            std::atomic<long long> g_gradients(0);
+            std::atomic<long long> g_peak(0);
+
+            std::mutex g_mutex;
+            // Scopes are never freed: nodes keep pointers to the one they were created in.
+            std::deque<MemoryScope> g_scopes;
+            std::map<std::string, MemoryScope *> g_scope_index;
+
+            thread_local const MemoryScope *t_last_scope = nullptr;
+
+            void raise(std::atomic<long long> &peak, long long value)
+            {
+                long long prev = peak.load();
+                while (value > prev && !peak.compare_exchange_weak(prev, value));
+            }
+
+            void updatePeak()
+            {
+                raise(g_peak, g_activations.load() + g_gradients.load());
+            }
+
+            std::string formatBytes(size_t bytes)
+            {
+                char buf[32];
+                if (bytes < 1024 * 1024) {
+                    snprintf(buf, sizeof(buf), "%.2f KB", bytes / 1024.0);
+                } else {
+                    snprintf(buf, sizeof(buf), "%.2f MB", bytes / (1024.0 * 1024.0));
+                }
+                return buf;
+            }
+        }
+
+        void MemoryTracker::start()
+        {
+            g_enabled = true;
+        }
+
+        void MemoryTracker::stop()
+        {
+            g_enabled = false;
+        }
+
+        bool MemoryTracker::isEnabled()
+        {
+            return g_enabled.load(std::memory_order_relaxed);
+        }
+
+        void MemoryTracker::resetPeak()
+        {
+            g_peak = g_activations.load() + g_gradients.load();
+            std::lock_guard<std::mutex> lock(g_mutex);
+            for (auto &scope : g_scopes) {
+                scope.peak = scope.live.load();
+            }
+        }
+
+        const MemoryScope *MemoryTracker::currentScope()
+        {
+            // Consecutive nodes are almost always created in the same module.
+            const std::string &name = Profiler::currentModule();
+            const MemoryScope *last = t_last_scope;
+            if (last && last->name == name) return last;
+
+            std::lock_guard<std::mutex> lock(g_mutex);
+            auto iter = g_scope_index.find(name);
+            if (iter == g_scope_index.end()) {
+                g_scopes.emplace_back();
+                g_scopes.back().name = name;
+                g_scopes.back().live = 0;
+                g_scopes.back().peak = 0;
+                iter = g_scope_index.insert(std::make_pair(name, &g_scopes.back())).first;
+            }
+            t_last_scope = iter->second;
+            return iter->second;
+        }
+
+        void MemoryTracker::addActivation(const MemoryScope *scope, long long bytes)
+        {
+            g_activations += bytes;
+            MemoryScope *mutable_scope = const_cast<MemoryScope *>(scope);
+            long long live = (mutable_scope->live += bytes);
+            if (bytes > 0) {
+                raise(mutable_scope->peak, live);
+                updatePeak();
+            }
+        }
+
+        void MemoryTracker::addGradient(long long bytes)
+        {
+            g_gradients += bytes;
+            if (bytes > 0) updatePeak();
+        }
+
+        MemoryReport MemoryTracker::report(const std::vector<Variable> &parameters,
+                                           size_t optimizer_state)
+        {
+            MemoryReport res;
+            res.activations = g_activations.load();
+            res.gradients = g_gradients.load();
+            res.parameters = 0;
+            for (const auto &parameter : parameters) {
+                res.parameters += parameter.array().bytes();
+            }
+            res.optimizer_state = optimizer_state;
+            res.peak = g_peak.load() + res.parameters + optimizer_state;
+
+            size_t alloc_bytes, alloc_buffers, lock_bytes, lock_buffers;
+            af::deviceMemInfo(&alloc_bytes, &alloc_buffers, &lock_bytes, &lock_buffers);
+            res.device_allocated = alloc_bytes;
+            res.device_in_use = lock_bytes;
+
+            std::lock_guard<std::mutex> lock(g_mutex);
+            for (const auto &scope : g_scopes) {
+                if (scope.peak == 0) continue;
+                res.modules.push_back(MemoryReport::Module{scope.name.empty() ? "<none>" : scope.name,
+                            (size_t)scope.live.load(), (size_t)scope.peak.load()});
+            }
+            return res;
+        }
+
+        std::string MemoryReport::str() const
+        {
+            std::string res;
+            res += "Activations:      " + formatBytes(activations) + "\n";
+            res += "Gradients:        " + formatBytes(gradients) + "\n";
+            res += "Parameters:       " + formatBytes(parameters) + "\n";
+            res += "Optimizer state:  " + formatBytes(optimizer_state) + "\n";
+            res += "Peak:             " + formatBytes(peak) + "\n";
+            res += "Device in use:    " + formatBytes(device_in_use) +
+                " (" + formatBytes(device_allocated) + " allocated)\n";
+
+            if (!modules.empty()) {
+                char buf[128];
+                snprintf(buf, sizeof(buf), "\n%-40s %14s %14s\n", "Module", "Activations", "Peak");
+                res += buf;
+                for (const auto &module : modules) {
+                    snprintf(buf, sizeof(buf), "%-40s %14s %14s\n", module.name.c_str(),
+                             formatBytes(module.activations).c_str(),
+                             formatBytes(module.peak_activations).c_str());
+                    res += buf;
+                }
+            }
+            return res;
+        }
+    }
+}
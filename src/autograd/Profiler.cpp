@@ -0,0 +1,384 @@
+/*******************************************************
+ * Copyright (c) 2017, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+
+#include <af/autograd/MemoryTracker.hpp>
+#include <af/autograd/Profiler.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace af {
+    namespace autograd {
+
+        struct ProfileTag
+        {
+            std::string op;
+            std::string scope;
+        };
+
+        namespace
+        {
+            typedef std::chrono::steady_clock Clock_t;
+
+            std::atomic<bool> g_enabled(false);
+            std::atomic<bool> g_sync(false);
+            std::atomic<int> g_num_threads(0);
+
+            std::mutex g_mutex;
+            Clock_t::time_point g_origin = Clock_t::now();
+            std::vector<Profiler::Event> g_events;
+
+            // Tags are never freed: nodes created while profiling keep pointers to them.
+            std::deque<ProfileTag> g_tags;
+            std::map<std::pair<const char *, std::string>, const ProfileTag *> g_tag_index;
+
+            // Module path of the ops created on this thread, e.g. "Sequential.1/Sequential.0".
+            thread_local std::string t_scope;
+
+            // Number of op and grad function scopes open on this thread. Only the outermost is recorded.
+            thread_local int t_depth = 0;
+            thread_local const ProfileTag *t_tag = nullptr;
+            thread_local ProfileScope *t_op_scope = nullptr;
+            thread_local int t_thread = -1;
+
+            double now()
+            {
+                return std::chrono::duration<double, std::micro>(Clock_t::now() - g_origin).count();
+            }
+
+            int threadIndex()
+            {
+                if (t_thread < 0) t_thread = g_num_threads++;
+                return t_thread;
+            }
+
+            const ProfileTag *intern(const char *op, const std::string &scope)
+            {
+                std::lock_guard<std::mutex> lock(g_mutex);
+                auto key = std::make_pair(op, scope);
+                auto iter = g_tag_index.find(key);
+                if (iter != g_tag_index.end()) return iter->second;
+
+                g_tags.push_back(ProfileTag{op, scope});
+                g_tag_index[key] = &g_tags.back();
+                return &g_tags.back();
+            }
+
+            void push(Profiler::Event &&event)
+            {
+                std::lock_guard<std::mutex> lock(g_mutex);
+                g_events.push_back(std::move(event));
+            }
+
+            const char *typeName(af::dtype type)
+            {
+                switch (type) {
+                case f32: return "f32";
+                case f64: return "f64";
+                case f16: return "f16";
+                case c32: return "c32";
+                case c64: return "c64";
+                case b8:  return "b8";
+                case s32: return "s32";
+                case u32: return "u32";
+                case u8:  return "u8";
+                case s64: return "s64";
+                case u64: return "u64";
+                case s16: return "s16";
+                case u16: return "u16";
+                default:  return "unknown";
+                }
+            }
+
+            std::string dimsString(const af::dim4 &dims)
+            {
+                char buf[96];
+                snprintf(buf, sizeof(buf), "[%lld, %lld, %lld, %lld]",
+                         (long long)dims[0], (long long)dims[1],
+                         (long long)dims[2], (long long)dims[3]);
+                return buf;
+            }
+
+            std::string escape(const std::string &str)
+            {
+                std::string res;
+                for (char c : str) {
+                    if (c == '"' || c == '\\') res.push_back('\\');
+                    res.push_back(c);
+                }
+                return res;
+            }
+
+            bool inScope(const std::string &scope, const std::string &module)
+            {
+                return scope.compare(0, module.size(), module) == 0 &&
+                    (scope.size() == module.size() || scope[module.size()] == '/');
+            }
+        }
+
+        void Profiler::start(bool sync_device)
+        {
+            g_sync = sync_device;
+            g_enabled = true;
+        }
+
+        void Profiler::stop()
+        {
+            g_enabled = false;
+            g_sync = false;
+        }
+
+        bool Profiler::isEnabled()
+        {
+            return g_enabled.load(std::memory_order_relaxed);
+        }
+
+        bool Profiler::isSyncing()
+        {
+            return g_sync.load(std::memory_order_relaxed);
+        }
+
+        void Profiler::clear()
+        {
+            std::lock_guard<std::mutex> lock(g_mutex);
+            g_events.clear();
+        }
+
+        std::vector<Profiler::Event> Profiler::events()
+        {
+            std::lock_guard<std::mutex> lock(g_mutex);
+            return g_events;
+        }
+
+        const ProfileTag *Profiler::currentTag()
+        {
+            return t_tag;
+        }
+
+        const std::string &Profiler::currentModule()
+        {
+            return t_scope;
+        }
+
+        void Profiler::recordOutput(const af::array &data)
+        {
+            // The outermost op's result is the last array created in its scope.
+            ProfileScope *scope = t_op_scope;
+            if (!scope) return;
+            scope->m_dims = data.dims();
+            scope->m_type = data.type();
+            if (isSyncing()) data.eval();
+        }
+
+        void Profiler::exportChromeTrace(const std::string &path)
+        {
+            std::ofstream out(path.c_str());
+            if (!out) {
+                throw af::exception("Profiler: Unable to open trace file.");
+            }
+
+            auto events = Profiler::events();
+            out << "{\"traceEvents\": [\n";
+            for (size_t i = 0; i < events.size(); i++) {
+                const auto &event = events[i];
+                out << "  {\"name\": \"" << escape(event.name) << "\""
+                    << ", \"cat\": \"" << event.phase << "\""
+                    << ", \"ph\": \"X\", \"pid\": 0"
+                    << ", \"tid\": " << event.thread
+                    << ", \"ts\": " << event.start_us
+                    << ", \"dur\": " << event.device_us
+                    << ", \"args\": {\"scope\": \"" << escape(event.scope) << "\"";
+                if (event.phase != "module") {
+                    out << ", \"dims\": \"" << dimsString(event.dims) << "\""
+                        << ", \"dtype\": \"" << typeName(event.type) << "\""
+                        << ", \"host_us\": " << event.host_us;
+                }
+                out << "}}" << (i + 1 < events.size() ? ",\n" : "\n");
+            }
+            out << "]}\n";
+        }
+
+        std::string Profiler::summary()
+        {
+            struct Row
+            {
+                int calls;
+                double host_us;
+                double device_us;
+            };
+
+            auto events = Profiler::events();
+
+            std::vector<std::string> modules;
+            std::map<std::string, Row> module_rows;
+            std::map<std::pair<std::string, std::pair<std::string, std::string> >, Row> op_rows;
+            for (const auto &event : events) {
+                if (event.phase == "module") {
+                    auto &row = module_rows[event.scope];
+                    if (row.calls == 0) modules.push_back(event.scope);
+                    row.calls++;
+                    row.device_us += event.device_us;
+                    continue;
+                }
+                auto &row = op_rows[std::make_pair(event.scope, std::make_pair(event.name, event.phase))];
+                row.calls++;
+                row.host_us += event.host_us;
+                row.device_us += event.device_us;
+            }
+
+            std::string res;
+            char buf[256];
+
+            if (!modules.empty()) {
+                snprintf(buf, sizeof(buf), "%-40s %8s %14s %14s\n",
+                         "Module", "Calls", "Forward (ms)", "Backward (ms)");
+                res += buf;
+                for (const auto &module : modules) {
+                    double backward_us = 0;
+                    for (const auto &event : events) {
+                        if (event.phase == "backward" && inScope(event.scope, module)) {
+                            backward_us += event.device_us;
+                        }
+                    }
+                    const auto &row = module_rows[module];
+                    snprintf(buf, sizeof(buf), "%-40s %8d %14.3f %14.3f\n",
+                             module.c_str(), row.calls, row.device_us / 1000, backward_us / 1000);
+                    res += buf;
+                }
+                res += "\n";
+            }
+
+            std::vector<std::pair<double, decltype(op_rows)::const_iterator> > order;
+            for (auto iter = op_rows.begin(); iter != op_rows.end(); iter++) {
+                order.push_back(std::make_pair(iter->second.device_us, iter));
+            }
+            std::sort(order.begin(), order.end(),
+                      [](const decltype(order)::value_type &lhs, const decltype(order)::value_type &rhs) {
+                          return lhs.first > rhs.first;
+                      });
+
+            snprintf(buf, sizeof(buf), "%-40s %-16s %-9s %8s %12s %12s %12s\n",
+                     "Scope", "Op", "Phase", "Calls", "Host (ms)", "Device (ms)", "Avg (us)");
+            res += buf;
+            for (const auto &entry : order) {
+                const auto &key = entry.second->first;
+                const auto &row = entry.second->second;
+                snprintf(buf, sizeof(buf), "%-40s %-16s %-9s %8d %12.3f %12.3f %12.1f\n",
+                         key.first.c_str(), key.second.first.c_str(), key.second.second.c_str(),
+                         row.calls, row.host_us / 1000, row.device_us / 1000,
+                         row.device_us / row.calls);
+                res += buf;
+            }
+            return res;
+        }
+
+        ProfileScope::ProfileScope(const char *name, bool backward) :
+            m_active(false)
+        {
+            if (!Profiler::isEnabled() || t_depth > 0) return;
+            m_dims_from_output = !backward;
+            begin(intern(name, t_scope), backward ? "backward" : "forward");
+        }
+
+        ProfileScope::ProfileScope(const ProfileTag *tag, const af::array &data) :
+            m_active(false)
+        {
+            if (!tag || !Profiler::isEnabled() || t_depth > 0) return;
+            m_dims_from_output = false;
+            begin(tag, "backward");
+            m_dims = data.dims();
+            m_type = data.type();
+        }
+
+        void ProfileScope::begin(const ProfileTag *tag, const char *phase)
+        {
+            m_active = true;
+            m_tag = tag;
+            m_phase = phase;
+            m_type = f32;
+
+            // Arrays created by a grad function are gradients, not the node's output.
+            m_prev_tag = t_tag;
+            m_prev_scope = t_op_scope;
+            t_tag = tag;
+            t_op_scope = m_dims_from_output ? this : nullptr;
+            t_depth++;
+
+            if (Profiler::isSyncing()) af::sync();
+            m_start_us = now();
+        }
+
+        ProfileScope::~ProfileScope()
+        {
+            if (!m_active) return;
+
+            double host_end = now();
+            if (Profiler::isSyncing()) af::sync();
+            double device_end = now();
+
+            t_depth--;
+            t_tag = m_prev_tag;
+            t_op_scope = m_prev_scope;
+
+            push(Profiler::Event{m_tag->op, m_tag->scope, m_phase, m_dims, m_type,
+                        threadIndex(), m_start_us, host_end - m_start_us, device_end - m_start_us});
+        }
+
+        ModuleProfileScope::ModuleProfileScope(const std::string &name) :
+            m_active(Profiler::isEnabled() || MemoryTracker::isEnabled()),
+            m_record(false)
+        {
+            if (m_active) begin(name);
+        }
+
+        ModuleProfileScope::ModuleProfileScope(size_t index) :
+            m_active(Profiler::isEnabled() || MemoryTracker::isEnabled()),
+            m_record(false)
+        {
+            if (m_active) begin(std::to_string(index));
+        }
+
+        void ModuleProfileScope::begin(const std::string &name)
+        {
+            m_prev_length = t_scope.size();
+            if (!t_scope.empty()) t_scope += "/";
+            t_scope += name;
+
+            // Modules recomputed by a grad function are accounted to its backward event.
+            m_record = Profiler::isEnabled() && t_depth == 0;
+            if (m_record) {
+                if (Profiler::isSyncing()) af::sync();
+                m_start_us = now();
+            }
+        }
+
+        ModuleProfileScope::~ModuleProfileScope()
+        {
+            if (!m_active) return;
+
+            if (m_record) {
+                if (Profiler::isSyncing()) af::sync();
+                double duration = now() - m_start_us;
+                size_t begin = t_scope.find_last_of('/');
+                std::string name = t_scope.substr(begin == std::string::npos ? 0 : begin + 1);
+                push(Profiler::Event{name, t_scope, "module", af::dim4(), f32,
+                            threadIndex(), m_start_us, duration, duration});
+            }
+            t_scope.resize(m_prev_length);
+        }
+    }
+}
@@ -0,0 +1,75 @@
+/*******************************************************
+ * Copyright (c) 2017, ArrayFire
+ * All rights reserved.
+ *
+ * This file is distributed under 3-clause BSD license.
+ * The complete license agreement can be obtained at:
+ * http://arrayfire.com/licenses/BSD-3-Clause
+ ********************************************************/
+
+#include <af/autograd/Tape.hpp>
+
+namespace af {
+    namespace autograd {
+
+        Tape::Tape(const StepFunc_t &step) :
+            m_step(step),
+            m_recorded(false),
+            m_nodes(),
+            m_order(),
+            m_pass()
+        {
+        }
+
+        Variable Tape::replay(const std::vector<af::array> &inputs)
+        {
+            std::vector<Variable> vars;
+            vars.reserve(inputs.size());
+            for (const auto &input : inputs) {
+                vars.push_back(Variable(input, false));
+            }
+
+            Variable result;
+            if (!m_recorded) {
+                Variable::DAG_t *prev = Variable::record(&m_nodes);
+                try {
+                    result = m_step(vars);
+                } catch (...) {
+                    Variable::record(prev);
+                    m_nodes.clear();
+                    throw;
+                }
+                Variable::record(prev);
+
+                // Leaves precede every node that uses them in topological order.
+                Variable::collectLeaves(m_order, m_nodes);
+                m_order.insert(m_order.end(), m_nodes.begin(), m_nodes.end());
+                m_recorded = true;
+            } else {
+                Variable::replay(&m_nodes);
+                try {
+                    result = m_step(vars);
+                } catch (...) {
+                    Variable::replay(nullptr);
+                    throw;
+                }
+                if (Variable::replay(nullptr) != m_nodes.size()) {
+                    throw af::exception("Tape: step built a different graph than the recorded one.");
+                }
+            }
+
+            if (result.isCalcGrad()) {
+                result.addGrad(Variable(af::constant(1, result.dims(), result.type()), false));
+
+                // The graph is kept for the next replay, a parallel pass empties the list it gets.
+                m_pass.assign(m_order.begin(), m_order.end());
+                Variable::propagate(m_pass, false, false);
+                m_pass.clear();
+                for (auto &node : m_nodes) {
+                    node.recycleGrad();
+                }
+            }
+            return result;
+        }
+    }
+}
@@ -8,45 +8,362 @@
  ********************************************************/
 
 #include <af/autograd/Variable.hpp>
+#include <af/autograd/BackwardCache.hpp>
 #include <af/autograd/Functions.hpp>
+#include <af/autograd/MemoryTracker.hpp>
+#include <af/autograd/Profiler.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
 
 namespace af {
     namespace autograd {
 
+        namespace
+        {
+            // Every call to Variable::build stamps the nodes it visits with a fresh epoch,
+            // so no per-pass set of visited nodes has to be maintained.
+            std::atomic<unsigned> g_build_epoch(0);
+
+            // Scratch buffers reused across backward passes on the same thread.
+            thread_local Variable::DAG_t t_dag;
+            thread_local std::vector<std::pair<const Variable *, size_t> > t_build_stack;
+
+            thread_local bool t_grad_enabled = true;
+
+            // When set, graph nodes are appended here as they are created (see Tape).
+            thread_local Variable::DAG_t *t_recording = nullptr;
+
+            // When set, graph nodes are reused from here instead of being created (see Tape).
+            thread_local const Variable::DAG_t *t_replaying = nullptr;
+            thread_local size_t t_replay_pos = 0;
+
+            // Nodes are created and destroyed by the thousand every training step. They are
+            // recycled through a free list owned by the thread that releases them, so steady
+            // state training neither calls into nor contends on the global allocator.
+            const size_t kMaxFreeNodes = 1 << 16;
+
+            thread_local bool t_free_list_alive = false;
+
+            struct FreeList
+            {
+                void *m_head;
+                size_t m_count;
+
+                FreeList() :
+                    m_head(nullptr),
+                    m_count(0)
+                {
+                    t_free_list_alive = true;
+                }
+
+                ~FreeList()
+                {
+                    t_free_list_alive = false;
+                    while (m_head) {
+                        void *next = *static_cast<void **>(m_head);
+                        ::operator delete(m_head);
+                        m_head = next;
+                    }
+                }
+            };
+
+            template<typename T>
+            struct NodeAllocator
+            {
+                typedef T value_type;
+
+                NodeAllocator() {}
+
+                template<typename U>
+                NodeAllocator(const NodeAllocator<U> &) {}
+
+                T *allocate(size_t n)
+                {
+                    FreeList &list = freeList();
+                    if (n == 1 && list.m_head) {
+                        void *block = list.m_head;
+                        list.m_head = *static_cast<void **>(block);
+                        list.m_count--;
+                        return static_cast<T *>(block);
+                    }
+                    return static_cast<T *>(::operator new(n * sizeof(T)));
+                }
+
+                void deallocate(T *ptr, size_t n)
+                {
+                    // Blocks freed while the thread is shutting down go straight back.
+                    if (n != 1 || !t_free_list_alive || freeList().m_count >= kMaxFreeNodes) {
+                        ::operator delete(ptr);
+                        return;
+                    }
+                    FreeList &list = freeList();
+                    *reinterpret_cast<void **>(ptr) = list.m_head;
+                    list.m_head = ptr;
+                    list.m_count++;
+                }
+
+                // One list per block type, as allocate_shared rebinds to its own node type.
+                static FreeList &freeList()
+                {
+                    static thread_local FreeList list;
+                    return list;
+                }
+            };
+
+            template<typename T, typename U>
+            bool operator ==(const NodeAllocator<T> &, const NodeAllocator<U> &) { return true; }
+
+            template<typename T, typename U>
+            bool operator !=(const NodeAllocator<T> &, const NodeAllocator<U> &) { return false; }
+
+            std::atomic<int> g_backward_threads(1);
+
+            // Set on threads taking part in a parallel backward pass. Gradients may
+            // then be pushed to a node from several threads at once.
+            thread_local bool t_parallel_backward = false;
+
+            // Depth of grad function calls on this thread. Backward passes started from within
+            // a grad function only cover part of the graph, so they don't fire grad hooks.
+            thread_local int t_grad_func_depth = 0;
+
+            const size_t kNumGradLocks = 64;
+            std::mutex g_grad_locks[kNumGradLocks];
+
+            std::mutex &gradLock(const void *node)
+            {
+                return g_grad_locks[(reinterpret_cast<uintptr_t>(node) >> 4) % kNumGradLocks];
+            }
+
+            // Persistent threads that run a job alongside the thread that submits it.
+            class WorkerPool
+            {
+            public:
+                WorkerPool() :
+                    m_job(nullptr),
+                    m_generation(0),
+                    m_slots(0),
+                    m_active(0),
+                    m_stop(false)
+                {
+                }
+
+                ~WorkerPool()
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(m_mutex);
+                        m_stop = true;
+                    }
+                    m_start.notify_all();
+                    for (auto &thread : m_threads) {
+                        thread.join();
+                    }
+                }
+
+                // Runs job on num_threads threads, the calling one included, and waits for all of them.
+                void run(int num_threads, const std::function<void()> &job)
+                {
+                    std::lock_guard<std::mutex> run_lock(m_run_mutex);
+                    {
+                        std::lock_guard<std::mutex> lock(m_mutex);
+                        while ((int)m_threads.size() < num_threads - 1) {
+                            m_threads.emplace_back(&WorkerPool::loop, this, m_generation);
+                        }
+                        m_job = &job;
+                        m_slots = num_threads - 1;
+                        m_active = num_threads - 1;
+                        m_generation++;
+                    }
+                    m_start.notify_all();
+
+                    job();
+
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_done.wait(lock, [this]() { return m_active == 0; });
+                    m_job = nullptr;
+                }
+
+            private:
+                void loop(unsigned generation)
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    for (;;) {
+                        m_start.wait(lock, [this, generation]() {
+                                return m_stop || (m_generation != generation && m_slots > 0);
+                            });
+                        if (m_stop) return;
+
+                        generation = m_generation;
+                        m_slots--;
+                        const std::function<void()> *job = m_job;
+
+                        lock.unlock();
+                        (*job)();
+                        lock.lock();
+
+                        if (--m_active == 0) m_done.notify_all();
+                    }
+                }
+
+                std::mutex m_run_mutex;
+                std::mutex m_mutex;
+                std::condition_variable m_start;
+                std::condition_variable m_done;
+                std::vector<std::thread> m_threads;
+                const std::function<void()> *m_job;
+                unsigned m_generation;
+                int m_slots;
+                int m_active;
+                bool m_stop;
+            };
+
+            WorkerPool &workerPool()
+            {
+                static WorkerPool pool;
+                return pool;
+            }
+
+            // State shared by the threads of one parallel backward pass.
+            struct ParallelPass
+            {
+                std::mutex m_mutex;
+                std::condition_variable m_ready_cv;
+                Variable::DAG_t m_ready;
+                size_t m_remaining;
+                std::exception_ptr m_error;
+            };
+
+            template<typename Container>
+            bool anyCalcGrad(const Container &inputs)
+            {
+                for (const auto &input : inputs) {
+                    if (input.isCalcGrad()) return true;
+                }
+                return false;
+            }
+        }
+
+        void setBackwardThreads(int num_threads)
+        {
+            g_backward_threads = num_threads < 1 ? 1 : num_threads;
+        }
+
+        int getBackwardThreads()
+        {
+            return g_backward_threads;
+        }
+
+        bool isGradEnabled()
+        {
+            return t_grad_enabled;
+        }
+
+        void setGradEnabled(bool enabled)
+        {
+            t_grad_enabled = enabled;
+        }
+
+        GradModeGuard::GradModeGuard(bool enabled) :
+            m_prev(t_grad_enabled)
+        {
+            t_grad_enabled = enabled;
+        }
+
+        GradModeGuard::~GradModeGuard()
+        {
+            t_grad_enabled = m_prev;
+        }
+
+        NoGradGuard::NoGradGuard() :
+            GradModeGuard(false)
+        {
+        }
+
         Variable::Shared::Shared() :
             m_calc_grad(true),
+            m_visit_epoch(0),
+            m_pending_consumers(0),
             m_data(),
             m_inputs(),
-            m_grads(),
-            m_grad_func(nullptr)
+            m_grad(std::shared_ptr<Shared>()),
+            m_overwrite_grad(false),
+            m_released(false),
+            m_version(0),
+            m_grad_func(nullptr),
+            m_grad_hooks(),
+            m_profile_tag(nullptr),
+            m_memory_scope(nullptr),
+            m_data_bytes(0),
+            m_grad_bytes(0)
         {}
 
         Variable::Shared::Shared(const af::array &data, bool calc_grad) :
             m_calc_grad(calc_grad),
+            m_visit_epoch(0),
+            m_pending_consumers(0),
             m_data(data),
             m_inputs(),
-            m_grads(),
-            m_grad_func(nullptr)
+            m_grad(std::shared_ptr<Shared>()),
+            m_overwrite_grad(false),
+            m_released(false),
+            m_version(0),
+            m_grad_func(nullptr),
+            m_grad_hooks(),
+            m_profile_tag(nullptr),
+            m_memory_scope(nullptr),
+            m_data_bytes(0),
+            m_grad_bytes(0)
         {}
 
         Variable::Shared::Shared(const af::array &data,
-                                 const std::vector<Variable> &inputs,
+                                 const Variable *first_input,
+                                 const Variable *last_input,
                                  GradFunc_t grad_func,
                                  bool calc_grad) :
             m_calc_grad(calc_grad),
+            m_visit_epoch(0),
+            m_pending_consumers(0),
             m_data(data),
-            m_inputs(inputs.begin(), inputs.end()),
-            m_grads(),
-            m_grad_func(grad_func)
+            m_inputs(first_input, last_input),
+            m_grad(std::shared_ptr<Shared>()),
+            m_overwrite_grad(false),
+            m_released(false),
+            m_version(0),
+            m_grad_func(std::move(grad_func)),
+            m_grad_hooks(),
+            m_profile_tag(nullptr),
+            m_memory_scope(nullptr),
+            m_data_bytes(0),
+            m_grad_bytes(0)
         {}
 
+        Variable::Shared::~Shared()
+        {
+            if (m_data_bytes) MemoryTracker::addActivation(m_memory_scope, -(long long)m_data_bytes);
+            if (m_grad_bytes) MemoryTracker::addGradient(-(long long)m_grad_bytes);
+        }
+
+        template<typename... Args>
+        std::shared_ptr<Variable::Shared> Variable::makeShared(Args &&... args)
+        {
+            return std::allocate_shared<Shared>(NodeAllocator<Shared>(), std::forward<Args>(args)...);
+        }
+
         Variable::Variable() :
-            m_shared(new Shared())
+            m_shared(makeShared())
         {
         }
 
         Variable::Variable(const af::array &data, bool calc_grad) :
-            m_shared(new Shared(data, calc_grad))
+            m_shared(makeShared(data, calc_grad))
+        {}
+
+        Variable::Variable(std::shared_ptr<Shared> shared) :
+            m_shared(std::move(shared))
         {}
 
         Variable::Variable(const af::array &data,
@@ -54,15 +371,81 @@ namespace af {
                            GradFunc_t grad_func) :
             m_shared(nullptr)
         {
-            bool calc_grad = false;
-            for (const auto &input : inputs) {
-                calc_grad |= input.isCalcGrad();
+            if (t_grad_enabled && anyCalcGrad(inputs)) {
+                if (t_replaying) {
+                    reuseNode(data, inputs.data(), inputs.data() + inputs.size(), std::move(grad_func));
+                } else {
+                    m_shared = makeShared(data, inputs.data(), inputs.data() + inputs.size(),
+                                                        std::move(grad_func), true);
+                    if (t_recording) t_recording->push_back(*this);
+                }
+                if (MemoryTracker::isEnabled()) trackActivation();
+            } else {
+                m_shared = makeShared(data, false);
             }
-            if (calc_grad) {
-                m_shared = std::shared_ptr<Shared>(new Shared(data, inputs, grad_func, true));
+            if (Profiler::isEnabled()) profileOutput();
+        }
+
+        Variable::Variable(const af::array &data,
+                           std::initializer_list<Variable> inputs,
+                           GradFunc_t grad_func) :
+            m_shared(nullptr)
+        {
+            // The node and its control block share one pooled allocation, and
+            // the inputs are copied straight into the node's inline storage.
+            if (t_grad_enabled && anyCalcGrad(inputs)) {
+                if (t_replaying) {
+                    reuseNode(data, inputs.begin(), inputs.end(), std::move(grad_func));
+                } else {
+                    m_shared = makeShared(data, inputs.begin(), inputs.end(),
+                                                        std::move(grad_func), true);
+                    if (t_recording) t_recording->push_back(*this);
+                }
+                if (MemoryTracker::isEnabled()) trackActivation();
             } else {
-                m_shared = std::shared_ptr<Shared>(new Shared(data, false));
+                m_shared = makeShared(data, false);
+            }
+            if (Profiler::isEnabled()) profileOutput();
+        }
+
+        void Variable::reuseNode(const af::array &data,
+                                 const Variable *first_input,
+                                 const Variable *last_input,
+                                 GradFunc_t grad_func)
+        {
+            if (t_replay_pos == t_replaying->size()) {
+                throw af::exception("Tape: step built a different graph than the recorded one.");
+            }
+            const Variable &node = (*t_replaying)[t_replay_pos];
+
+            // The node must be fed by the same nodes as when it was recorded. Only the
+            // inputs that don't need gradients, i.e. data, may differ: they are replaced.
+            Inputs_t &recorded = node.getInputs();
+            size_t num_inputs = last_input - first_input;
+            bool same = recorded.size() == num_inputs;
+            for (size_t i = 0; same && i < num_inputs; i++) {
+                const Variable &input = first_input[i];
+                same = input.isCalcGrad() == recorded[i].isCalcGrad() &&
+                    (!input.isCalcGrad() || input.m_shared == recorded[i].m_shared);
+            }
+            if (!same) {
+                throw af::exception("Tape: step built a different graph than the recorded one.");
             }
+            t_replay_pos++;
+
+            m_shared = node.m_shared;
+            for (size_t i = 0; i < num_inputs; i++) {
+                if (!first_input[i].isCalcGrad()) recorded[i] = first_input[i];
+            }
+            if (m_shared->m_data_bytes) {
+                MemoryTracker::addActivation(m_shared->m_memory_scope, -(long long)m_shared->m_data_bytes);
+                m_shared->m_data_bytes = 0;
+            }
+            m_shared->m_data = data;
+            m_shared->m_version++;
+            m_shared->m_grad_func = std::move(grad_func);
+            m_shared->m_overwrite_grad = true;
+            m_shared->m_released = false;
         }
 
         af::array& Variable::array() const
@@ -75,10 +458,10 @@ namespace af {
             if (!m_shared->m_calc_grad) {
                 throw af::exception("Gradient calclation disabled.");
             }
-            if (m_shared->m_grads.size() == 0) {
+            if (!m_shared->hasGrad()) {
                 throw af::exception("Gradient hasn't been calculated yet.");
             }
-            return m_shared->m_grads[0];
+            return m_shared->m_grad;
         }
 
         std::ptrdiff_t Variable::id() const
@@ -86,7 +469,7 @@ namespace af {
             return (std::ptrdiff_t)m_shared.get();
         }
 
-        std::vector<Variable>& Variable::getInputs() const
+        Variable::Inputs_t& Variable::getInputs() const
         {
             return m_shared->m_inputs;
         }
@@ -99,7 +482,7 @@ namespace af {
         bool Variable::isGradAvailable() const
         {
             if (!m_shared->m_calc_grad) return false;
-            return m_shared->m_grads.size() >= 1;
+            return m_shared->hasGrad();
         }
 
         af::dim4 Variable::dims() const
@@ -114,7 +497,8 @@ namespace af {
 
         void Variable::zeroGrad()
         {
-            m_shared->m_grads.clear();
+            // The buffer is kept, so parameters don't reallocate their gradients every step.
+            m_shared->m_overwrite_grad = true;
         }
 
         void Variable::setCalcGrad(bool calc_grad)
@@ -123,78 +507,528 @@ namespace af {
             if (!calc_grad) {
                 m_shared->m_grad_func = nullptr;
                 m_shared->m_inputs.clear();
-                m_shared->m_grads.clear();
+                m_shared->m_grad = Variable(std::shared_ptr<Shared>());
+                m_shared->m_released = false;
+                trackGrads();
             }
         }
 
         void Variable::addGrad(const Variable &child_grad)
         {
             if (m_shared->m_calc_grad) {
-                m_shared->m_grads.push_back(child_grad);
+                // Computes the gradient within the profiled grad function that produced it.
+                if (Profiler::isSyncing()) child_grad.array().eval();
+                if (t_parallel_backward) {
+                    std::lock_guard<std::mutex> lock(gradLock(m_shared.get()));
+                    accumulateGrad(child_grad);
+                } else {
+                    accumulateGrad(child_grad);
+                }
             }
         }
 
+        void Variable::accumulateGrad(const Variable &child_grad)
+        {
+            Variable &grad = m_shared->m_grad;
+
+            // The buffer is ours alone when no one else holds the node, it may then be
+            // updated in place instead of being replaced by a new node.
+            bool in_place = grad.m_shared && grad.m_shared.use_count() == 1 &&
+                !grad.isCalcGrad() && !child_grad.isCalcGrad();
+
+            if (!m_shared->hasGrad()) {
+                // Best not to evaluate the JIT immediately if theres only a single gradient
+                if (in_place) {
+                    grad.array() = child_grad.array();
+                    grad.m_shared->m_version++;
+                } else {
+                    grad = child_grad;
+                }
+                m_shared->m_overwrite_grad = false;
+            } else {
+                // Summing contributions as they arrive frees each one as soon as it is added.
+                ProfileScope scope("accumulateGrad", true);
+                if (in_place) {
+                    grad.array() += child_grad.array();
+                    grad.m_shared->m_version++;
+                } else {
+                    grad = grad + child_grad;
+                }
+                grad.array().eval();
+            }
+            trackGrads();
+        }
+
         void Variable::evalGrad(bool retain_grad_graph)
         {
             // Flag asking not to calculate gradients
             if (!m_shared->m_calc_grad) return;
 
-            // Best not to evaluate the JIT immediately if theres only a single gradient
-            Variable grad = m_shared->m_grads[0];
-            if (m_shared->m_grads.size() > 1) {
-                for (unsigned i = 1; i < m_shared->m_grads.size(); i++) {
-                    grad = grad + m_shared->m_grads[i];
+            // Nothing downstream contributed a gradient
+            if (!m_shared->hasGrad()) return;
+
+            // Other nodes may hold the same gradient, e.g. both inputs of an add, possibly on
+            // other threads: it is replaced rather than modified.
+            Variable &grad = m_shared->m_grad;
+            if (grad.isCalcGrad() != retain_grad_graph) {
+                grad = Variable(grad.array(), retain_grad_graph);
+            }
+        }
+
+        void Variable::calcGradInputs(bool retain_grad_graph)
+        {
+            // Unless the gradients themselves are to be differentiated, the ops in the
+            // grad functions only need their data: don't build graph nodes for them.
+            GradModeGuard guard(t_grad_enabled && retain_grad_graph);
+            ProfileScope scope(m_shared->m_grad_func ? m_shared->m_profile_tag : nullptr, m_shared->m_data);
+
+            evalGrad(retain_grad_graph);
+            if (m_shared->m_grad_func && m_shared->hasGrad()) {
+                t_grad_func_depth++;
+                try {
+                    m_shared->m_grad_func(m_shared->m_inputs, m_shared->m_grad, *this);
+                } catch (...) {
+                    t_grad_func_depth--;
+                    throw;
                 }
-                grad.array().eval();
-                m_shared->m_grads.resize(1);
+                t_grad_func_depth--;
             }
+        }
 
-            grad.setCalcGrad(retain_grad_graph);
-            m_shared->m_grads[0] = grad;
+        void Variable::profileOutput()
+        {
+            m_shared->m_profile_tag = Profiler::currentTag();
+            Profiler::recordOutput(m_shared->m_data);
         }
 
-        void Variable::calcGradInputs(bool retain_grad_graph)
+        void Variable::trackActivation()
         {
-            evalGrad();
+            m_shared->m_memory_scope = MemoryTracker::currentScope();
+            m_shared->m_data_bytes = m_shared->m_data.bytes();
+            MemoryTracker::addActivation(m_shared->m_memory_scope, m_shared->m_data_bytes);
+        }
+
+        void Variable::trackGrads()
+        {
+            // Keeps releasing what was counted after tracking stops.
+            if (!MemoryTracker::isEnabled() && m_shared->m_grad_bytes == 0) return;
+
+            // A buffer flagged for overwriting is still held.
+            size_t bytes = 0;
+            if (MemoryTracker::isEnabled() && m_shared->m_grad.m_shared) {
+                bytes = m_shared->m_grad.array().bytes();
+            }
+            MemoryTracker::addGradient((long long)bytes - (long long)m_shared->m_grad_bytes);
+            m_shared->m_grad_bytes = bytes;
+        }
+
+        void Variable::registerGradHook(GradHook_t hook)
+        {
+            m_shared->m_grad_hooks.push_back(std::move(hook));
+        }
+
+        void Variable::clearGradHooks()
+        {
+            m_shared->m_grad_hooks.clear();
+        }
+
+        void Variable::fireGradHooks()
+        {
+            if (m_shared->m_grad_hooks.empty() || t_grad_func_depth > 0) return;
+            if (m_shared->m_grad_func || !isGradAvailable()) return;
+            for (auto &hook : m_shared->m_grad_hooks) {
+                hook(*this);
+            }
+        }
+
+        void Variable::releaseGraph()
+        {
+            // Leaves keep their gradients, they are what the caller is after.
             if (m_shared->m_grad_func) {
-                m_shared->m_grad_func(m_shared->m_inputs, m_shared->m_grads[0]);
+                m_shared->m_grad = Variable(std::shared_ptr<Shared>());
+                m_shared->m_released = true;
+                trackGrads();
+            }
+            m_shared->m_grad_func = nullptr;
+            m_shared->m_inputs.clear();
+        }
+
+        void Variable::recycleGrad()
+        {
+            Variable &grad = m_shared->m_grad;
+            if (grad.m_shared && grad.m_shared.use_count() == 1 && !grad.isCalcGrad()) {
+                grad.array() = af::array();
+            } else {
+                grad = Variable(std::shared_ptr<Shared>());
+            }
+            m_shared->m_overwrite_grad = true;
+            trackGrads();
+        }
+
+        void Variable::checkGraph(const Variable &var)
+        {
+            // A released node has nothing behind it: gradients reaching it would be dropped.
+            if (var.m_shared->m_released && var.m_shared->m_calc_grad) {
+                throw af::exception("Variable's graph was freed by a previous backward pass. "
+                                    "Pass retain_grad_graph = true to backward to keep it.");
             }
         }
 
         void Variable::backward(const Variable &grad, bool retain_grad_graph)
         {
+            // Borrow the cached buffer, leaving an empty one behind for any
+            // backward pass that a gradient function may start from within this one.
+            Variable::DAG_t dag;
+            dag.swap(t_dag);
+
+            Variable::build(dag, *this);
             this->addGrad(grad);
-            Variable::DAG_t dag = Variable::build(*this);
-            for (auto iter = dag.rbegin(); iter != dag.rend(); iter++) {
-                iter->calcGradInputs(retain_grad_graph);
+            Variable::propagate(dag, retain_grad_graph, !retain_grad_graph);
+
+            dag.clear();
+            dag.swap(t_dag);
+        }
+
+        void backward(const std::vector<Variable> &roots,
+                      const std::vector<Variable> &grads,
+                      bool retain_grad_graph)
+        {
+            backward(roots, grads, {}, retain_grad_graph);
+        }
+
+        void backward(const std::vector<Variable> &roots,
+                      const std::vector<Variable> &grads,
+                      const std::vector<Variable> &stops,
+                      bool retain_grad_graph)
+        {
+            if (!grads.empty() && grads.size() != roots.size()) {
+                throw af::exception("backward: Expected one gradient per root.");
+            }
+
+            Variable::DAG_t dag;
+            dag.swap(t_dag);
+
+            Variable::build(dag, roots, stops);
+
+            // All seeds are in place before the combined DAG is traversed, so a node
+            // shared by several roots fires once, with every contribution summed.
+            for (size_t i = 0; i < roots.size(); i++) {
+                Variable root = roots[i];
+                root.addGrad(grads.empty() ?
+                             Variable(af::constant(1, root.dims(), root.type()), false) :
+                             grads[i]);
             }
+            Variable::propagate(dag, retain_grad_graph, !retain_grad_graph);
+
+            dag.clear();
+            dag.swap(t_dag);
         }
 
         void Variable::backward(bool retain_grad_graph)
         {
-            auto ones = Variable(af::constant(1, this->dims()), false);
+            auto ones = Variable(af::constant(1, this->dims(), this->type()), false);
             this->backward(ones, retain_grad_graph);
         }
 
-        Variable::DAG_t Variable::build(const Variable &var)
+        void Variable::propagate(Variable::DAG_t &dag, bool retain_grad_graph, bool release_graph)
         {
-            Cache_t cache;
-            Variable::DAG_t dag;
-            Variable::buildSubGraph(cache, dag, var);
-            return dag;
+            // Passes started by a grad function within a parallel pass run sequentially.
+            int num_threads = g_backward_threads;
+            if (num_threads > 1 && dag.size() > 1 && !t_parallel_backward) {
+                Variable::propagateParallel(dag, retain_grad_graph, release_graph, num_threads);
+                return;
+            }
+
+            BackwardCache cache(retain_grad_graph);
+            for (auto iter = dag.rbegin(); iter != dag.rend(); iter++) {
+                iter->calcGradInputs(retain_grad_graph);
+                iter->fireGradHooks();
+
+                // Every consumer of this node fired before it did, so unless the
+                // graph is being kept for higher order gradients nothing will read
+                // its inputs or gradient again. Dropping them along with the DAG's
+                // own reference lets activations be freed as the pass proceeds.
+                if (release_graph) {
+                    Variable var = std::move(*iter);
+                    var.releaseGraph();
+                }
+            }
         }
 
-        void Variable::buildSubGraph(Cache_t &cache, Variable::DAG_t &dag, const Variable &var)
+        void Variable::propagateParallel(Variable::DAG_t &dag, bool retain_grad_graph, bool release_graph,
+                                         int num_threads)
         {
-            std::ptrdiff_t id = var.id();
-            if (cache.find(id) != cache.end()) {
-                return;
+            // A node is ready once every consumer in the DAG has pushed its gradient.
+            for (auto &node : dag) {
+                node.m_shared->m_pending_consumers = 0;
+            }
+            for (auto &node : dag) {
+                for (const auto &input : node.getInputs()) {
+                    if (input.isCalcGrad()) input.m_shared->m_pending_consumers++;
+                }
+            }
+
+            ParallelPass pass;
+            pass.m_remaining = dag.size();
+            for (auto &node : dag) {
+                if (node.m_shared->m_pending_consumers == 0) pass.m_ready.push_back(node);
+            }
+
+            // From here on nodes are kept alive by their consumers or the ready list, so
+            // each one can be released as soon as it fires, as in the sequential pass.
+            dag.clear();
+
+            int device = af::getDevice();
+            auto job = [&pass, retain_grad_graph, release_graph, device]() {
+                af::setDevice(device);
+                bool prev_parallel = t_parallel_backward;
+                t_parallel_backward = true;
+                BackwardCache cache(retain_grad_graph);
+
+                Variable::DAG_t ready;
+                std::unique_lock<std::mutex> lock(pass.m_mutex);
+                for (;;) {
+                    pass.m_ready_cv.wait(lock, [&pass]() {
+                            return !pass.m_ready.empty() || pass.m_remaining == 0 || pass.m_error;
+                        });
+                    if (pass.m_remaining == 0 || pass.m_error) break;
+
+                    Variable var = std::move(pass.m_ready.back());
+                    pass.m_ready.pop_back();
+                    lock.unlock();
+
+                    try {
+                        var.calcGradInputs(retain_grad_graph);
+                        var.fireGradHooks();
+                        for (const auto &input : var.getInputs()) {
+                            if (!input.isCalcGrad()) continue;
+                            if (--input.m_shared->m_pending_consumers == 0) ready.push_back(input);
+                        }
+                        if (release_graph) var.releaseGraph();
+                    } catch (...) {
+                        lock.lock();
+                        if (!pass.m_error) pass.m_error = std::current_exception();
+                        pass.m_ready_cv.notify_all();
+                        break;
+                    }
+
+                    lock.lock();
+                    for (auto &node : ready) {
+                        pass.m_ready.push_back(std::move(node));
+                    }
+                    ready.clear();
+                    if (--pass.m_remaining == 0 || pass.m_ready.size() > 1) {
+                        pass.m_ready_cv.notify_all();
+                    }
+                }
+                lock.unlock();
+
+                t_parallel_backward = prev_parallel;
+            };
+            workerPool().run(num_threads, job);
+
+            if (pass.m_error) std::rethrow_exception(pass.m_error);
+        }
+
+        void Variable::collectLeaves(Variable::DAG_t &leaves, const Variable::DAG_t &nodes)
+        {
+            unsigned epoch = ++g_build_epoch;
+            for (const auto &node : nodes) {
+                node.m_shared->m_visit_epoch = epoch;
+            }
+            for (const auto &node : nodes) {
+                for (const auto &input : node.getInputs()) {
+                    if (input.m_shared->m_visit_epoch == epoch) continue;
+                    input.m_shared->m_visit_epoch = epoch;
+                    if (input.isCalcGrad()) leaves.push_back(input);
+                }
+            }
+        }
+
+        Variable::DAG_t *Variable::record(Variable::DAG_t *nodes)
+        {
+            Variable::DAG_t *prev = t_recording;
+            t_recording = nodes;
+            return prev;
+        }
+
+        size_t Variable::replay(const Variable::DAG_t *nodes)
+        {
+            size_t used = t_replay_pos;
+            t_replaying = nodes;
+            t_replay_pos = 0;
+            return used;
+        }
+
+        void Variable::build(Variable::DAG_t &dag, const Variable &var)
+        {
+            dag.clear();
+            Variable::visit(dag, var, ++g_build_epoch);
+        }
+
+        void Variable::build(Variable::DAG_t &dag, const std::vector<Variable> &roots,
+                             const std::vector<Variable> &stops)
+        {
+            // Sharing one epoch across roots keeps common subgraphs from being visited twice.
+            // Stops are stamped upfront, so they and whatever lies behind them are never visited.
+            unsigned epoch = ++g_build_epoch;
+            dag.clear();
+            for (const auto &stop : stops) {
+                stop.m_shared->m_visit_epoch = epoch;
+            }
+            for (const auto &root : roots) {
+                if (root.m_shared->m_visit_epoch == epoch) continue;
+                Variable::visit(dag, root, epoch);
+            }
+        }
+
+        void Variable::visit(Variable::DAG_t &dag, const Variable &var, unsigned epoch)
+        {
+            // Iterative post-order DFS. Each frame holds a node and the index of
+            // the next input to visit, so deep graphs do not exhaust the call stack.
+            auto &stack = t_build_stack;
+            stack.clear();
+
+            checkGraph(var);
+            var.m_shared->m_visit_epoch = epoch;
+            stack.push_back(std::make_pair(&var, (size_t)0));
+
+            while (!stack.empty()) {
+                auto &top = stack.back();
+                const auto &inputs = top.first->getInputs();
+                if (top.second < inputs.size()) {
+                    const Variable &input = inputs[top.second++];
+                    // Inputs that don't need gradients are data only, with nothing behind them.
+                    if (!input.isCalcGrad()) continue;
+                    if (input.m_shared->m_visit_epoch != epoch) {
+                        checkGraph(input);
+                        input.m_shared->m_visit_epoch = epoch;
+                        stack.push_back(std::make_pair(&input, (size_t)0));
+                    }
+                } else {
+                    dag.push_back(*top.first);
+                    stack.pop_back();
+                }
+            }
+        }
+
+        std::vector<Variable> grad(const std::vector<Variable> &outputs,
+                                   const std::vector<Variable> &inputs,
+                                   const std::vector<Variable> &grad_outputs,
+                                   bool retain_grad_graph)
+        {
+            if (!grad_outputs.empty() && grad_outputs.size() != outputs.size()) {
+                throw af::exception("grad: Expected one gradient per output.");
+            }
+            for (const auto &input : inputs) {
+                if (!input.isCalcGrad()) {
+                    throw af::exception("grad: Input does not require gradients.");
+                }
+            }
+
+            Variable::DAG_t dag;
+            Variable::build(dag, outputs);
+
+            // Keep only the nodes that depend on one of the inputs, marking them with a new epoch.
+            unsigned epoch = ++g_build_epoch;
+            for (const auto &input : inputs) {
+                input.m_shared->m_visit_epoch = epoch;
+            }
+            Variable::DAG_t subgraph;
+            for (const auto &node : dag) {
+                bool needed = node.m_shared->m_visit_epoch == epoch;
+                for (const auto &input : node.getInputs()) {
+                    needed = needed || input.m_shared->m_visit_epoch == epoch;
+                }
+                if (needed) {
+                    node.m_shared->m_visit_epoch = epoch;
+                    subgraph.push_back(node);
+                }
             }
-            for (const auto &input : var.getInputs()) {
-                Variable::buildSubGraph(cache, dag, input);
+            dag.clear();
+
+            // Inputs of the subgraph that lie outside of it are treated as not needing
+            // gradients for the duration of the call, so grad functions skip them. A retained
+            // gradient graph must still depend on them, to be differentiated w.r.t. them later:
+            // they are then appended to the subgraph, where they come first in reverse order
+            // and so never propagate what they receive. The gradients of all these nodes
+            // are set aside so none leak into or out of the call.
+            Variable::DAG_t frozen;
+            size_t num_nodes = subgraph.size();
+            for (size_t i = 0; i < num_nodes; i++) {
+                for (const auto &input : subgraph[i].getInputs()) {
+                    if (input.m_shared->m_visit_epoch != epoch && input.m_shared->m_calc_grad) {
+                        input.m_shared->m_visit_epoch = epoch;
+                        if (retain_grad_graph) {
+                            subgraph.push_back(input);
+                        } else {
+                            input.m_shared->m_calc_grad = false;
+                            frozen.push_back(input);
+                        }
+                    }
+                }
             }
-            cache[id] = true;
-            dag.push_back(var);
+            // Requested inputs that the outputs don't reach are not in the subgraph, but may
+            // hold gradients from an earlier backward pass: those are set aside as well.
+            // Everything set aside is stamped with a new epoch.
+            Variable::DAG_t set_aside(subgraph.begin(), subgraph.end());
+            unsigned listed = ++g_build_epoch;
+            for (auto &node : set_aside) {
+                node.m_shared->m_visit_epoch = listed;
+            }
+            for (const auto &input : inputs) {
+                if (input.m_shared->m_visit_epoch != listed) {
+                    input.m_shared->m_visit_epoch = listed;
+                    set_aside.push_back(input);
+                }
+            }
+
+            std::vector<std::pair<std::shared_ptr<Variable::Shared>, bool> > saved_grads;
+            saved_grads.reserve(set_aside.size());
+            for (auto &node : set_aside) {
+                Variable::Shared &shared = *node.m_shared;
+                saved_grads.emplace_back(std::move(shared.m_grad.m_shared), shared.m_overwrite_grad);
+                shared.m_overwrite_grad = false;
+            }
+            auto restore = [&]() {
+                for (auto &var : frozen) var.m_shared->m_calc_grad = true;
+                for (size_t i = 0; i < set_aside.size(); i++) {
+                    Variable::Shared &shared = *set_aside[i].m_shared;
+                    shared.m_grad.m_shared = std::move(saved_grads[i].first);
+                    shared.m_overwrite_grad = saved_grads[i].second;
+                    set_aside[i].trackGrads();
+                }
+            };
+
+            std::vector<Variable> result;
+            try {
+                for (size_t i = 0; i < outputs.size(); i++) {
+                    Variable output = outputs[i];
+                    if (output.m_shared->m_visit_epoch != listed) continue;
+                    output.addGrad(grad_outputs.empty() ?
+                                   Variable(af::constant(1, output.dims(), output.type()), false) :
+                                   grad_outputs[i]);
+                }
+
+                BackwardCache cache(retain_grad_graph);
+                for (auto iter = subgraph.rbegin(); iter != subgraph.rend(); iter++) {
+                    iter->calcGradInputs(retain_grad_graph);
+                }
+
+                for (const auto &input : inputs) {
+                    if (input.isGradAvailable()) {
+                        result.push_back(input.grad());
+                    } else {
+                        result.push_back(Variable(af::constant(0, input.dims(), input.type()), false));
+                    }
+                }
+            } catch (...) {
+                restore();
+                throw;
+            }
+
+            restore();
+            return result;
         }
     }
 }
@@ -34,7 +34,7 @@ namespace af
 
         Variable ReLU::forward(const Variable &input)
         {
-            return max(input, 0.0);
+            return relu(input);
         }
 
         LeakyReLU::LeakyReLU(double slope) :
@@ -44,7 +44,7 @@ namespace af
 
         Variable LeakyReLU::forward(const Variable &input)
         {
-            return max(input, m_slope * input);
+            return leakyRelu(input, m_slope);
         }
 
         PReLU::PReLU(int size, double value)
@@ -60,8 +60,7 @@ namespace af
 
         Variable PReLU::forward(const Variable &input)
         {
-            auto mask = input >= 0.0;
-            return (input * mask) + (input * !mask * tileAs(m_parameters[0], input));
+            return prelu(input, m_parameters[0]);
         }
 
         ELU::ELU(double alpha) :
@@ -71,8 +70,7 @@ namespace af
 
         Variable ELU::forward(const Variable &input)
         {
-            auto mask = input >= 0.0;
-            return (mask * input) + (!mask * m_alpha * (exp(input)-1));
+            return elu(input, m_alpha);
         }
 
         ThresholdReLU::ThresholdReLU(double threshold) :
@@ -82,8 +80,7 @@ namespace af
 
         Variable ThresholdReLU::forward(const Variable &input)
         {
-            auto mask = input >= m_threshold;
-            return input * mask;
+            return threshold(input, m_threshold);
         }
     }
 }
@@ -7,9 +7,13 @@
  * http://arrayfire.com/licenses/BSD-3-Clause
  ********************************************************/
 
+#include <af/autograd/Functions.hpp>
+#include <af/autograd/Profiler.hpp>
 #include <af/autograd/Variable.hpp>
 #include <af/nn/Modules/Container.hpp>
 
+#include <algorithm>
+
 namespace af
 {
     namespace nn
@@ -28,13 +32,47 @@ namespace af
             return m_modules;
         }
 
-        Sequential::Sequential() {}
+        Sequential::Sequential() :
+            m_checkpoint_size(0)
+        {
+        }
+
+        void Sequential::setCheckpointSize(int segment_size)
+        {
+            m_checkpoint_size = segment_size;
+        }
 
         Variable Sequential::forward(const Variable &input)
         {
             Variable output = input;
-            for (auto &module : m_modules) {
-                output = module->forward(output);
+            if (m_checkpoint_size <= 0) {
+                for (size_t i = 0; i < m_modules.size(); i++) {
+                    ModuleProfileScope scope(i);
+                    output = m_modules[i]->forward(output);
+                }
+                return output;
+            }
+
+            for (size_t begin = 0; begin < m_modules.size(); begin += m_checkpoint_size) {
+                size_t end = std::min(begin + m_checkpoint_size, m_modules.size());
+                std::vector<ModulePtr> segment(m_modules.begin() + begin, m_modules.begin() + end);
+
+                std::vector<Variable> params;
+                for (auto &module : segment) {
+                    for (auto &param : module->parameters()) {
+                        params.push_back(param);
+                    }
+                }
+
+                auto fn = [segment, begin](const std::vector<Variable> &inputs) {
+                    Variable res = inputs[0];
+                    for (size_t i = 0; i < segment.size(); i++) {
+                        ModuleProfileScope scope(begin + i);
+                        res = segment[i]->forward(res);
+                    }
+                    return res;
+                };
+                output = checkpoint(fn, {output}, params);
             }
             return output;
         }
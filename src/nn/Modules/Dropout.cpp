@@ -8,7 +8,6 @@
  ********************************************************/
 #include <af/autograd/Functions.hpp>
 
-#include <af/nn/Init.hpp>
 #include <af/nn/Modules/Dropout.hpp>
 
 namespace af
@@ -25,7 +24,7 @@ namespace af
         Variable Dropout::forward(const Variable &input)
         {
             if(m_train)
-                return (uniform(input.dims(), 0.0, 1.0, f32, false) > m_ratio) * input;
+                return dropout(input, m_ratio);
             else
                 return input;
         }
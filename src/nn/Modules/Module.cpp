@@ -49,6 +49,13 @@ namespace af
             }
         }
 
+        void Module::cast(af::dtype type)
+        {
+            for (auto &parameter : m_parameters) {
+                parameter.array() = parameter.array().as(type);
+            }
+        }
+
         std::vector<Variable> Module::parameters()
         {
             return m_parameters;
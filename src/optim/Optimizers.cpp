@@ -7,6 +7,7 @@
  * http://arrayfire.com/licenses/BSD-3-Clause
  ********************************************************/
 
+#include <af/autograd/Functions.hpp>
 #include <af/optim/Optimizers.hpp>
 
 #include <cmath>
@@ -26,9 +27,85 @@ namespace af
 {
     namespace optim
     {
+        namespace
+        {
+            size_t bytes(const vector<af::array> &arrays)
+            {
+                size_t res = 0;
+                for (const auto &array : arrays) {
+                    res += array.bytes();
+                }
+                return res;
+            }
+        }
+
         Optimizer::Optimizer(const vector<Variable> &parameters)
-            : m_parameters(parameters.begin(), parameters.end())
+            : m_parameters(parameters.begin(), parameters.end()),
+              m_master(),
+              m_grads(),
+              m_dynamic_scaling(false),
+              m_loss_scale(1),
+              m_growth_interval(0),
+              m_good_steps(0)
+        {
+            m_master.reserve(m_parameters.size());
+            for (const auto &parameter : m_parameters) {
+                if (parameter.type() == f16) {
+                    m_master.push_back(parameter.array().as(f32));
+                    m_master.back().eval();
+                } else {
+                    m_master.push_back(af::array());
+                }
+            }
+        }
+
+        af::array& Optimizer::data(size_t i)
+        {
+            return m_master[i].isempty() ? m_parameters[i].array() : m_master[i];
+        }
+
+        const af::array& Optimizer::grad(size_t i) const
         {
+            return m_grads[i];
+        }
+
+        bool Optimizer::update()
+        {
+            m_grads.resize(m_parameters.size());
+            af::array overflow = af::constant(0, 1, u32);
+            for (size_t i = 0; i < m_parameters.size(); i++) {
+                af::array grad = m_parameters[i].grad().array();
+                if (!m_master[i].isempty()) grad = grad.as(f32);
+                if (m_loss_scale != 1) grad = grad / m_loss_scale;
+                if (m_dynamic_scaling) {
+                    overflow = overflow + af::count(af::flat(af::isNaN(grad) || af::isInf(grad)));
+                }
+                m_grads[i] = grad;
+            }
+
+            if (m_dynamic_scaling) {
+                // A single read back for all the parameters.
+                if (overflow.scalar<unsigned>() > 0) {
+                    m_loss_scale /= 2;
+                    m_good_steps = 0;
+                    m_grads.clear();
+                    return false;
+                }
+                if (++m_good_steps == m_growth_interval) {
+                    m_loss_scale *= 2;
+                    m_good_steps = 0;
+                }
+            }
+
+            step();
+            m_grads.clear();
+
+            for (size_t i = 0; i < m_parameters.size(); i++) {
+                if (m_master[i].isempty()) continue;
+                m_parameters[i].array() = m_master[i].as(f16);
+                m_parameters[i].array().eval();
+            }
+            return true;
         }
 
         void Optimizer::zeroGrad()
@@ -38,6 +115,30 @@ namespace af
             }
         }
 
+        void Optimizer::setLossScaling(double initial_scale, int growth_interval)
+        {
+            m_dynamic_scaling = true;
+            m_loss_scale = initial_scale;
+            m_growth_interval = growth_interval;
+            m_good_steps = 0;
+        }
+
+        Variable Optimizer::scaleLoss(const Variable &loss) const
+        {
+            if (m_loss_scale == 1) return loss;
+            return loss * m_loss_scale;
+        }
+
+        double Optimizer::getLossScale() const
+        {
+            return m_loss_scale;
+        }
+
+        size_t Optimizer::stateBytes() const
+        {
+            return bytes(m_master);
+        }
+
         SGDOptimizer::SGDOptimizer(const vector<Variable> &parameters,
                                    double learning_rate, double momentum,
                                    double weight_decay, bool use_nesterov)
@@ -50,19 +151,19 @@ namespace af
         {
             if (momentum != 0) {
                 m_velocities.reserve(parameters.size());
-                for (const auto &parameter : m_parameters) {
-                    m_velocities.push_back(af::constant(0, parameter.dims(), parameter.type()));
+                for (size_t i = 0; i < m_parameters.size(); i++) {
+                    m_velocities.push_back(af::constant(0, data(i).dims(), data(i).type()));
                     m_velocities.back().eval();
                 }
             }
         }
 
-        void SGDOptimizer::update()
+        void SGDOptimizer::step()
         {
             for (size_t i = 0; i < m_parameters.size(); i++) {
 
-                const af::array &grad = m_parameters[i].grad().array();
-                af::array &data = m_parameters[i].array();
+                const af::array &grad = this->grad(i);
+                af::array &data = this->data(i);
 
                 if (m_wd != 0) {
                     // Weight decay term
@@ -91,6 +192,11 @@ namespace af
         }
 
 
+        size_t SGDOptimizer::stateBytes() const
+        {
+            return Optimizer::stateBytes() + bytes(m_velocities);
+        }
+
         AdamOptimizer::AdamOptimizer(const vector<Variable> &parameters,
                                      double learning_rate,
                                      double beta1, double beta2,
@@ -108,20 +214,26 @@ namespace af
             m_biased_first.reserve(parameters.size());
             m_biased_second.reserve(parameters.size());
 
-            for (const auto &parameter : m_parameters) {
-                m_biased_first.push_back(af::constant(0, parameter.dims(), parameter.type()));
-                m_biased_second.push_back(af::constant(0, parameter.dims(), parameter.type()));
+            for (size_t i = 0; i < m_parameters.size(); i++) {
+                m_biased_first.push_back(af::constant(0, data(i).dims(), data(i).type()));
+                m_biased_second.push_back(af::constant(0, data(i).dims(), data(i).type()));
 
                 m_biased_first.back().eval();
                 m_biased_second.back().eval();
             }
         }
 
-        void AdamOptimizer::update()
+        void AdamOptimizer::step()
         {
+            m_count++;
+
+            double corrected_bias1 = 1 - std::pow(m_beta1, m_count);
+            double corrected_bias2 = 1 - std::pow(m_beta2, m_count);
+            double corrected_lr = m_lr * std::sqrt(corrected_bias2) / corrected_bias1;
+
             for (size_t i = 0; i < m_parameters.size(); i++) {
-                const af::array &grad = m_parameters[i].grad().array();
-                af::array &data = m_parameters[i].array();
+                const af::array &grad = this->grad(i);
+                af::array &data = this->data(i);
 
                 if (m_wd != 0) {
                     // Weight decay term
@@ -134,18 +246,17 @@ namespace af
                 biased_first  = m_beta1 * biased_first  + (1 - m_beta1) * grad;
                 biased_second = m_beta2 * biased_second + (1 - m_beta2) * grad * grad;
 
-                m_count++;
-
-                double corrected_bias1 = 1 - std::pow(m_beta1, m_count);
-                double corrected_bias2 = 1 - std::pow(m_beta2, m_count);
-                double corrected_lr = m_lr * std::sqrt(corrected_bias2) / corrected_bias1;
-
                 data = data - (corrected_lr * biased_first) / (af::sqrt(biased_second) + m_eps);
 
                 af::eval(data, biased_first, biased_second);
             }
         }
 
+        size_t AdamOptimizer::stateBytes() const
+        {
+            return Optimizer::stateBytes() + bytes(m_biased_first) + bytes(m_biased_second);
+        }
+
         RMSPropOptimizer::RMSPropOptimizer(const vector<Variable> &parameters,
                                            double learning_rate,
                                            double rho,
@@ -164,22 +275,22 @@ namespace af
             if (m_use_first) m_first.reserve(parameters.size());
             m_second.reserve(parameters.size());
 
-            for (const auto &parameter : m_parameters) {
+            for (size_t i = 0; i < m_parameters.size(); i++) {
                 if (m_use_first) {
-                    m_first.push_back(af::constant(0, parameter.dims(), parameter.type()));
+                    m_first.push_back(af::constant(0, data(i).dims(), data(i).type()));
                     m_first.back().eval();
                 }
 
-                m_second.push_back(af::constant(0, parameter.dims(), parameter.type()));
+                m_second.push_back(af::constant(0, data(i).dims(), data(i).type()));
                 m_second.back().eval();
             }
         }
 
-        void RMSPropOptimizer::update()
+        void RMSPropOptimizer::step()
         {
             for (size_t i = 0; i < m_parameters.size(); i++) {
-                const af::array &grad = m_parameters[i].grad().array();
-                af::array &data = m_parameters[i].array();
+                const af::array &grad = this->grad(i);
+                af::array &data = this->data(i);
 
                 if (m_wd != 0) {
                     // Weight decay term
@@ -207,5 +318,10 @@ namespace af
                 }
             }
         }
+
+        size_t RMSPropOptimizer::stateBytes() const
+        {
+            return Optimizer::stateBytes() + bytes(m_first) + bytes(m_second);
+        }
     }
 }